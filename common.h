@@ -5,7 +5,7 @@
 
 #include <gcrypt.h>
 
-#define NEED_LIBGCRYPT_VERSION "1.11.0"
+#define NEED_LIBGCRYPT_VERSION "1.10.0"
 
 #define sizeofarr(arr) (sizeof(arr) / sizeof(*arr))
 
@@ -31,7 +31,6 @@ static char *duplicate_string(char *s) {
 }
 
 static bool init_libgcrypt() {
-	return true;
 	// Directly copied from:
 	// https://gnupg.org/documentation/manuals/gcrypt/Initializing-the-library.html
 
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "gallery.h"
+
+void gallery_init(GalleryState *state) {
+	state->length = 0;
+	state->capacity = 0;
+	state->slots = NULL;
+}
+
+void gallery_free(GalleryState *state) {
+	for (size_t i = 0; i < state->capacity; i++) free(state->slots[i].name);
+	free(state->slots);
+	gallery_init(state);
+}
+
+// fnv-1a over the role and name
+uint64_t gallery_hash(LogPersonRole role, const char *name) {
+	uint64_t hash = 0xcbf29ce484222325ull;
+	hash = (hash ^ (uint8_t)role) * 0x100000001b3ull;
+	while (*name != '\0') hash = (hash ^ (uint8_t)*name++) * 0x100000001b3ull;
+	return hash;
+}
+
+// Returns the slot a person lives in, or the empty slot they'd go into
+static GalleryPerson *gallery_slot(
+	GalleryPerson *slots, size_t capacity, LogPersonRole role,
+	const char *name) {
+	size_t mask = capacity - 1;
+	for (size_t i = (size_t)gallery_hash(role, name) & mask;;
+		i = (i + 1) & mask) {
+		GalleryPerson *slot = &slots[i];
+		if (slot->name == NULL ||
+			(slot->role == role && strcmp(slot->name, name) == 0))
+			return slot;
+	}
+}
+
+static void gallery_grow(GalleryState *state) {
+	size_t new_capacity = state->capacity ? state->capacity * 2 : 64;
+	GalleryPerson *new_slots = calloc(new_capacity, sizeof(GalleryPerson));
+	if (new_slots == NULL) die("failed to grow gallery table", 1);
+
+	for (size_t i = 0; i < state->capacity; i++) {
+		GalleryPerson *person = &state->slots[i];
+		if (person->name == NULL) continue;
+		*gallery_slot(new_slots, new_capacity, person->role, person->name) =
+			*person;
+	}
+
+	free(state->slots);
+	state->slots = new_slots;
+	state->capacity = new_capacity;
+}
+
+GalleryPerson *gallery_find(
+	GalleryState *state, LogPersonRole role, const char *name) {
+	if (state->capacity == 0) return NULL;
+	GalleryPerson *slot =
+		gallery_slot(state->slots, state->capacity, role, name);
+	return slot->name != NULL ? slot : NULL;
+}
+
+GalleryPerson *gallery_person(
+	GalleryState *state, LogPersonRole role, const char *name) {
+	GalleryPerson *slot = NULL;
+	if (state->capacity > 0)
+		slot = gallery_slot(state->slots, state->capacity, role, name);
+	if (slot != NULL && slot->name != NULL) return slot;
+
+	// kept at most half full, so probes stay short
+	if ((state->length + 1) * 2 > state->capacity) {
+		gallery_grow(state);
+		slot = gallery_slot(state->slots, state->capacity, role, name);
+	}
+
+	slot->name = duplicate_string((char *)name);
+	slot->role = role;
+	slot->location = GALLERY_OUTSIDE;
+	slot->room_id = UINT32_MAX;
+	slot->entered_at = 0;
+	slot->total_time = 0;
+	state->length++;
+	return slot;
+}
+
+const char *gallery_apply(GalleryState *state, const LogEntry *entry) {
+	GalleryPerson *person =
+		gallery_person(state, entry->person.role, entry->person.name);
+	bool whole_gallery = entry->room_id == UINT32_MAX;
+
+	if (entry->event == LOG_EVENT_ARRIVAL) {
+		if (whole_gallery) {
+			if (person->location != GALLERY_OUTSIDE)
+				return "person is already in the gallery";
+			person->location = GALLERY_LOBBY;
+			person->entered_at = entry->timestamp;
+		} else {
+			if (person->location == GALLERY_OUTSIDE)
+				return "person must arrive at the gallery before a room";
+			if (person->location == GALLERY_IN_ROOM)
+				return "person must leave their room before entering another";
+			person->location = GALLERY_IN_ROOM;
+			person->room_id = entry->room_id;
+		}
+	} else {
+		if (whole_gallery) {
+			if (person->location == GALLERY_OUTSIDE)
+				return "person isn't in the gallery";
+			if (person->location == GALLERY_IN_ROOM)
+				return "person must leave their room before the gallery";
+			person->location = GALLERY_OUTSIDE;
+			if (entry->timestamp > person->entered_at)
+				person->total_time += entry->timestamp - person->entered_at;
+		} else {
+			if (person->location != GALLERY_IN_ROOM ||
+				person->room_id != entry->room_id)
+				return "person isn't in that room";
+			person->location = GALLERY_LOBBY;
+			person->room_id = UINT32_MAX;
+		}
+	}
+
+	return NULL;
+}
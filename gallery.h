@@ -0,0 +1,48 @@
+#pragma once
+
+#include "logutils.h"
+
+// Where everyone is, as far as a log's events go. Used to hold events to the
+// gallery's rules, and as the basis for running totals (see rollup.h).
+//
+// the rules: you arrive at the gallery before entering any room, can only be
+// in one room at a time, leave a room before entering another, and leave
+// every room before leaving the gallery.
+
+typedef enum {
+	GALLERY_OUTSIDE = 'o',
+	GALLERY_LOBBY = 'g', // inside the gallery, but not in any room
+	GALLERY_IN_ROOM = 'r',
+} GalleryLocation;
+
+typedef struct {
+	char *name; // owned by the table
+	LogPersonRole role;
+	GalleryLocation location;
+	uint32_t room_id;    // only meaningful while GALLERY_IN_ROOM
+	uint32_t entered_at; // last arrival at the gallery
+	uint64_t total_time; // summed over visits that have ended
+} GalleryPerson;
+
+typedef struct {
+	size_t length;
+	size_t capacity;      // always a power of two, or zero
+	GalleryPerson *slots; // open addressing, empty slots have a NULL name
+} GalleryState;
+
+void gallery_init(GalleryState *);
+void gallery_free(GalleryState *);
+
+GalleryPerson *gallery_find(GalleryState *, LogPersonRole, const char *name);
+// returns NULL if they're not in the table yet
+
+GalleryPerson *gallery_person(GalleryState *, LogPersonRole, const char *name);
+// finds a person, adding them (outside the gallery) if they're new.
+// pointers stay valid until the next person is added.
+
+uint64_t gallery_hash(LogPersonRole, const char *name);
+// what the table (and the rollup's sidecar) files a person under
+
+const char *gallery_apply(GalleryState *, const LogEntry *);
+// moves the entry's person if the event is allowed by the rules above.
+// otherwise returns an error message and leaves everyone where they were.
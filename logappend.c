@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L // -> getline
+
 #include <stdlib.h> // -> EXIT_*
 #include <stdio.h>  // -> printf
 #include <string.h>
@@ -8,11 +10,14 @@
 
 #include "common.h"
 #include "logutils.h"
+#include "rollup.h"
+#include "scan.h"
 
 typedef struct {
 	char *given_token;
 	LogEntry entry;
 	char *log_file;
+	bool compact; // only matters when the log is new
 } Arguments;
 
 typedef struct {
@@ -26,6 +31,27 @@ typedef struct {
 	size_t length;
 } ArgumentsStringInfo;
 
+// rollup of one log touched by this run. only the records its events touch
+// are read in, and they're only written back once at the end, so a batch pays
+// for each record once, not per line.
+typedef struct {
+	char *log_file;
+	char *token;
+	bool maintained; // false if it couldn't be loaded or rebuilt
+	Rollup rollup;
+} RollupCacheItem;
+
+typedef struct {
+	size_t length;
+	RollupCacheItem *items;
+} RollupCache;
+
+// one event of an import dump, and the line it came from
+typedef struct {
+	LogEntry entry;
+	size_t line;
+} ImportRow;
+
 const char *validate_args(Arguments *args) {
 	const char *msg;
 
@@ -51,6 +77,7 @@ Arguments parse_args(size_t args_len, char *args[]) {
 	result.entry.event = '\0';
 	result.given_token = NULL;
 	result.log_file = NULL;
+	result.compact = false;
 
 	if (args_len < 1) die("got an empty args list", 1);
 
@@ -90,6 +117,9 @@ Arguments parse_args(size_t args_len, char *args[]) {
 			result.entry.room_id = strtoul(args[i + 1], &tail, 10);
 			if (tail != expected_tail) die("malformed number in room id", 1);
 			i++;
+		} else if (match_flag("-C")) {
+			// -C
+			result.compact = true;
 		} else {
 			// <log>
 			if (result.log_file != NULL)
@@ -114,6 +144,8 @@ Arguments parse_args(size_t args_len, char *args[]) {
 #define is_line_separator(c)  (c == '\n' || c == '\r')
 #define is_separator(c)       (is_field_separator(c) || is_line_separator(c))
 
+static const ScanSet args_separators = SCANSET4(' ', '\t', '\n', '\r');
+
 ArgumentsStringInfo parse_args_info(char *arg_string) {
 	ArgumentsStringInfo result;
 	result.fields_num = 0;
@@ -122,35 +154,31 @@ ArgumentsStringInfo parse_args_info(char *arg_string) {
 
 	if (arg_string == NULL || arg_string[0] == '\0') return result;
 
+	result.length = strlen(arg_string);
+	char *end = &arg_string[result.length];
+
 	// note that because we're really kinda "splitting" a string in half when we
 	// write a terminator in the middle of it, we *start* with one field and one
 	// line.
 	bool on_new_line = true;
 
-	// first scan: find length of string and count the fields and lines.
-	char curr, *iter;
-	for (iter = arg_string, curr = *iter; curr != '\0'; curr = *(++iter)) {
-		if (is_separator(curr)) {
-			on_new_line |= is_line_separator(curr);
-		} else {
-			result.fields_num++;
-			if (on_new_line) {
-				result.lines_num++;
-				on_new_line = false;
-			}
-
-			// eat rest of field
-			do curr = *(++iter);
-			while (curr != '\0' && !is_separator(curr));
-			// `iter` is left pointing at first non-separator character.
+	// first scan: count the fields and lines.
+	for (char *iter = arg_string; iter < end;) {
+		if (is_separator(*iter)) {
+			on_new_line |= is_line_separator(*iter);
+			iter++;
+			continue;
+		}
 
-			// without this, we'd step past the next character
-			// without checking it, because of `for` loop shenanigans.
-			iter--;
+		result.fields_num++;
+		if (on_new_line) {
+			result.lines_num++;
+			on_new_line = false;
 		}
-	}
 
-	result.length = iter - arg_string;
+		// eat rest of field, a whole bunch of bytes at a time
+		iter = (char *)scan_find(&args_separators, iter, end);
+	}
 
 	return result;
 }
@@ -179,37 +207,35 @@ ArgumentsList parse_args_batch(char *arg_string) {
 	size_t line_index = 0;
 	bool on_new_line = true;
 
-	for (size_t iter = 0; iter < info.length; ++iter) {
-		char curr = result.buffer[iter];
-		if (curr == '\0' || is_separator(curr)) {
-			on_new_line |= is_line_separator(curr);
-		} else {
-			char *field_start = &result.buffer[iter];
-
-			do curr = result.buffer[++iter];
-			while (iter < info.length && !is_separator(curr));
+	char *buffer_end = &result.buffer[info.length];
+	for (char *iter = result.buffer; iter < buffer_end;) {
+		if (is_separator(*iter)) {
+			on_new_line |= is_line_separator(*iter);
+			iter++;
+			continue;
+		}
 
-			// Do bookkeeping before we write the null terminator.
+		char *field_start = iter;
+		iter = (char *)scan_find(&args_separators, iter, buffer_end);
 
-			// if it's a line, save the next field index. it's important
-			if (on_new_line) {
-				first_field_of_lines[line_index++] = field_index;
-				on_new_line = false; // formality, lol..
-			}
+		// Do bookkeeping before we write the null terminator.
 
-			// a complete field item is inside the range
-			// result.buffer[field_start..iter]
-			fields[field_index++] = field_start;
+		// if it's a line, save the next field index. it's important
+		if (on_new_line) {
+			first_field_of_lines[line_index++] = field_index;
+			on_new_line = false; // formality, lol..
+		}
 
-			// before overwriting the separator, is it a newline?
-			// that might be important... ["didn't cause a mystery bug" voice]
-			on_new_line = is_line_separator(curr);
+		// a complete field item is inside the range
+		// result.buffer[field_start..iter]
+		fields[field_index++] = field_start;
 
-			// split off the string as we've reached the end of a field.
-			// all good if this is the null terminator, because it's null anyway
-			result.buffer[iter--] = '\0';
-			// without stepping back, we'd step past the next character
-			// without checking it, because of `for` loop shenanigans.
+		// before overwriting the separator, is it a newline?
+		// that might be important... ["didn't cause a mystery bug" voice]
+		// at the very end there's no separator, just the terminator.
+		if (iter < buffer_end) {
+			on_new_line = is_line_separator(*iter);
+			*iter++ = '\0';
 		}
 	}
 
@@ -246,6 +272,281 @@ void free_args_batch(ArgumentsList list) {
 	free(list.buffer);
 }
 
+// Finds the rollup for a log, opening it on first use. Call this before
+// appending to the log, so the log it was saved for can be checked.
+RollupCacheItem *rollup_cache_get(
+	RollupCache *cache, char *log_file, char *token, bool new_file) {
+	for (size_t i = 0; i < cache->length; i++) {
+		if (strcmp(cache->items[i].log_file, log_file) == 0)
+			return &cache->items[i];
+	}
+
+	cache->items =
+		realloc(cache->items, (cache->length + 1) * sizeof(RollupCacheItem));
+	if (cache->items == NULL) die("failed to grow rollup cache", 1);
+	RollupCacheItem *item = &cache->items[cache->length++];
+	item->log_file = log_file;
+	item->token = token;
+	item->maintained = true;
+
+	if (new_file) {
+		rollup_init(&item->rollup);
+		return item;
+	}
+
+	// a log we can't even open is about to fail its append anyway
+	MerkleHash log_mac;
+	if (!logfile_root_mac(log_file, token, &log_mac)) {
+		rollup_init(&item->rollup);
+		item->maintained = false;
+		return item;
+	}
+
+	const char *msg = rollup_open(&item->rollup, log_file, token, &log_mac);
+	if (msg != NULL) {
+		printf("rebuilding rollup for '%s': %s\n", log_file, msg);
+		rollup_free(&item->rollup);
+		item->maintained = rollup_rebuild(&item->rollup, log_file, token);
+	}
+
+	return item;
+}
+
+// Reads in the records an entry is about to change, starting the rollup over
+// from the log if any of them were tampered with
+void rollup_cache_fetch(RollupCacheItem *item, const LogEntry *entry) {
+	if (!item->maintained) return;
+	const char *msg = rollup_fetch(&item->rollup, entry);
+	if (msg == NULL) return;
+
+	printf("rebuilding rollup for '%s': %s\n", item->log_file, msg);
+	rollup_free(&item->rollup);
+	item->maintained =
+		rollup_rebuild(&item->rollup, item->log_file, item->token);
+}
+
+// Saves every rollup against the current root mac of its log, and frees them
+void rollup_cache_finish(RollupCache *cache) {
+	for (size_t i = 0; i < cache->length; i++) {
+		RollupCacheItem *item = &cache->items[i];
+		MerkleHash log_mac;
+		if (item->maintained &&
+			logfile_root_mac(item->log_file, item->token, &log_mac) &&
+			!rollup_save(&item->rollup, item->log_file, item->token,
+				&log_mac))
+			printf(CONSOLE_VIS_ERROR
+				"ERROR: couldn't save rollup for '%s'" CONSOLE_VIS_RESET "\n",
+				item->log_file);
+		rollup_free(&item->rollup);
+	}
+	free(cache->items);
+	cache->items = NULL;
+	cache->length = 0;
+}
+
+// Parses a whole decimal number, like -T and -R take
+// Returns false if it's empty, has anything but digits, or doesn't fit
+static bool import_parse_number(const char *field, uint32_t *out) {
+	uint64_t value = 0;
+	if (*field == '\0') return false;
+	for (; *field != '\0'; field++) {
+		if (*field < '0' || *field > '9') return false;
+		value = value * 10 + (*field - '0');
+		if (value > UINT32_MAX) return false;
+	}
+	*out = (uint32_t)value;
+	return true;
+}
+
+// Parses one line of an import dump into `out`, splitting `line` up in place.
+// Names are kept once per person in `people`, not once per event.
+// Returns an error message if the line is malformed.
+static const char *import_parse_line(
+	char *line, GalleryState *people, LogEntry *out) {
+	// the first separator on the line says whether it's csv or tsv
+	char separator = line[strcspn(line, ",\t")];
+	if (separator == '\0') return "expected comma or tab separated fields";
+
+	char *fields[6];
+	size_t fields_num = 0;
+	for (char *iter = line; iter != NULL && fields_num < 6;) {
+		fields[fields_num++] = iter;
+		iter = strchr(iter, separator);
+		if (iter != NULL) *iter++ = '\0';
+	}
+	if (fields_num < 4 || fields_num > 5)
+		return "expected <timestamp>,(E|G),<name>,(A|L)[,<room-id>]";
+
+	if (!import_parse_number(fields[0], &out->timestamp))
+		return "malformed number in timestamp";
+
+	if (strcmp(fields[1], "E") == 0) out->person.role = LOG_ROLE_EMPLOYEE;
+	else if (strcmp(fields[1], "G") == 0) out->person.role = LOG_ROLE_GUEST;
+	else return "role must be E (employee) or G (guest)";
+
+	if (strcmp(fields[3], "A") == 0) out->event = LOG_EVENT_ARRIVAL;
+	else if (strcmp(fields[3], "L") == 0) out->event = LOG_EVENT_DEPARTURE;
+	else return "event must be A (arrival) or L (departure)";
+
+	out->room_id = UINT32_MAX;
+	if (fields_num == 5 && fields[4][0] != '\0' &&
+		!import_parse_number(fields[4], &out->room_id))
+		return "malformed number in room id";
+
+	out->person.name = fields[2];
+	const char *msg = logentry_validate(out);
+	if (msg != NULL) return msg;
+
+	GalleryPerson *person = gallery_person(people, out->person.role, fields[2]);
+	out->person.name = person->name;
+	return NULL;
+}
+
+// Orders events by timestamp, keeping the dump's order for ties
+static int import_row_compare(const void *a_ptr, const void *b_ptr) {
+	const ImportRow *a = a_ptr, *b = b_ptr;
+	if (a->entry.timestamp != b->entry.timestamp)
+		return a->entry.timestamp < b->entry.timestamp ? -1 : 1;
+	return a->line < b->line ? -1 : a->line > b->line;
+}
+
+// Builds a new log, and its rollup, from a dump of events. The dump is read
+// in one pass, sorted only if it's out of order, checked against the
+// gallery's rules and then written out in one go.
+// Returns false (after printing why) if nothing was written.
+bool import_dump(
+	char *dump_file, char *token, char *log_file, LogEncoding encoding) {
+	FILE *test = fopen(log_file, "r");
+	if (test != NULL) {
+		fclose(test);
+		printf(CONSOLE_VIS_ERROR
+			"ERROR: '%s' already exists, imports only create new logs"
+			CONSOLE_VIS_RESET "\n",
+			log_file);
+		return false;
+	}
+
+	FILE *dump = fopen(dump_file, "r");
+	if (dump == NULL) {
+		printf(CONSOLE_VIS_ERROR
+			"ERROR: Unable to open file '%s'" CONSOLE_VIS_RESET "\n",
+			dump_file);
+		return false;
+	}
+
+	// the rollup's table of people doubles as the place names are kept
+	Rollup rollup;
+	rollup_init(&rollup);
+
+	ImportRow *rows = NULL;
+	size_t rows_num = 0, rows_capacity = 0;
+	bool sorted = true;
+
+	const char *msg = NULL;
+	size_t line_number = 0;
+	char *line = NULL;
+	size_t line_capacity = 0;
+	ssize_t line_length;
+	while ((line_length = getline(&line, &line_capacity, dump)) != -1) {
+		line_number++;
+		while (line_length > 0 &&
+			(line[line_length - 1] == '\n' || line[line_length - 1] == '\r'))
+			line[--line_length] = '\0';
+		// blank lines and comments
+		if (line_length == 0 || line[0] == '#') continue;
+
+		if (rows_num == rows_capacity) {
+			rows_capacity = rows_capacity ? rows_capacity * 2 : 1024;
+			rows = realloc(rows, rows_capacity * sizeof(ImportRow));
+			if (rows == NULL) die("failed to grow import", 1);
+		}
+
+		ImportRow *row = &rows[rows_num];
+		msg = import_parse_line(line, &rollup.people, &row->entry);
+		if (msg != NULL) break;
+		row->line = line_number;
+		if (rows_num > 0 && row->entry.timestamp < row[-1].entry.timestamp)
+			sorted = false;
+		rows_num++;
+	}
+	free(line);
+	fclose(dump);
+
+	if (msg == NULL && !sorted)
+		qsort(rows, rows_num, sizeof(ImportRow), import_row_compare);
+
+	// the rules can only be checked once everything's in order
+	for (size_t i = 0; msg == NULL && i < rows_num; i++) {
+		msg = rollup_apply(&rollup, &rows[i].entry);
+		line_number = rows[i].line;
+	}
+
+	if (msg == NULL && rows_num == 0) {
+		msg = "no events to import";
+		line_number = 0;
+	}
+	if (msg != NULL) {
+		printf(CONSOLE_VIS_ERROR
+			"ERROR: '%s' line %lu: %s" CONSOLE_VIS_RESET "\n",
+			dump_file, (unsigned long)line_number, msg);
+		free(rows);
+		rollup_free(&rollup);
+		return false;
+	}
+
+	LogFile file;
+	file.token_to_save = token;
+	file.encoding = encoding;
+	file.entries.length = rows_num;
+	file.entries.capacity = rows_num;
+	file.entries.entry = malloc(rows_num * sizeof(LogEntry));
+	if (file.entries.entry == NULL) die("failed to allocate log entries", 1);
+	for (size_t i = 0; i < rows_num; i++) file.entries.entry[i] = rows[i].entry;
+	file.records_num = rows_num;
+	file.ordinals = NULL;
+	free(rows);
+
+	logfile_write(log_file, &file);
+	// the names belong to the rollup, so only the entries go
+	free(file.entries.entry);
+
+	MerkleHash log_mac;
+	if (!logfile_root_mac(log_file, token, &log_mac) ||
+		!rollup_save(&rollup, log_file, token, &log_mac))
+		printf(CONSOLE_VIS_ERROR
+			"ERROR: couldn't save rollup for '%s'" CONSOLE_VIS_RESET "\n",
+			log_file);
+
+	printf("imported %lu events into '%s'\n", (unsigned long)rows_num,
+		log_file);
+	rollup_free(&rollup);
+	return true;
+}
+
+// Parses `-K <token> -I <dump> [-C] <log>`, in any order
+// Returns false if anything's missing or extra
+bool parse_import_args(int argv, char *argc[], char **token, char **dump_file,
+	char **log_file, bool *compact) {
+	*token = *dump_file = *log_file = NULL;
+	*compact = false;
+	for (int i = 1; i < argv; i++) {
+		if (strncmp(argc[i], "-K", 3) == 0 && i + 1 < argv && *token == NULL) {
+			*token = argc[++i];
+		} else if (strncmp(argc[i], "-C", 3) == 0 && !*compact) {
+			*compact = true;
+		} else if (strncmp(argc[i], "-I", 3) == 0 && i + 1 < argv &&
+			*dump_file == NULL) {
+			*dump_file = argc[++i];
+		} else if (argc[i][0] != '-' && *log_file == NULL) {
+			*log_file = argc[i];
+		} else {
+			return false;
+		}
+	}
+	return *token != NULL && validate_token(*token) == NULL &&
+		*dump_file != NULL && *log_file != NULL;
+}
+
 char *read_into_string(FILE *file, size_t *out_length) {
 #define BUFFER_GROW_BY 256
 	size_t local_length;
@@ -284,18 +585,42 @@ int main(int argv, char *argc[]) {
 			"logappend -T <timestamp> -K <token>\n"
 			"    ( -E <employee-name> | -G <guest-name> )\n"
 			"    ( -A | -L )\n"
-			"    [-R <room-id>]\n"
+			"    [-R <room-id>] [-C]\n"
 			"    <log>\n"
-			"# insert an entry\n"
+			"# insert an entry. -C makes a new log use the compact encoding,\n"
+			"# which is 1.5 to 3.5 times smaller (see README).\n"
+			"# existing logs keep theirs.\n"
 			"\n"
 			"logappend -B <file>\n"
 			"# execute list of commands read line-by-line from <file>\n"
 			"# the commands shouldn't start with the executable name,\n"
-			"# and they should resemble the first command's form.\n",
+			"# and they should resemble the first command's form.\n"
+			"\n"
+			"logappend -K <token> -I <dump> [-C] <log>\n"
+			"# build a new log from a dump of events, one per line:\n"
+			"#   <timestamp>,(E|G),<name>,(A|L)[,<room-id>]\n"
+			"# tabs can separate the fields instead. the events get sorted\n"
+			"# by timestamp, and have to follow the gallery's rules.\n",
 			argv ? argc[0] : "logappend");
 		exit(EXIT_FAILURE);
 	}
 
+	for (int i = 1; i < argv; i++) {
+		if (strncmp(argc[i], "-I", 3) != 0) continue;
+		// bulk import, nothing else applies
+		char *token, *dump_file, *log_file;
+		bool compact;
+		if (!parse_import_args(
+				argv, argc, &token, &dump_file, &log_file, &compact))
+			die("import takes -K <token> -I <dump> [-C] <log>", 1);
+		if (!init_libgcrypt()) return EXIT_FAILURE;
+		LogEncoding encoding =
+			compact ? LOG_ENCODING_COMPACT : LOG_ENCODING_TEXT;
+		return import_dump(dump_file, token, log_file, encoding)
+			? EXIT_SUCCESS
+			: EXIT_FAILURE;
+	}
+
 	bool use_batch_file = argv == 3 && strncmp(argc[1], "-B", 3) == 0;
 	printf("use batch file? %s\n", use_batch_file ? "yeah" : "no");
 
@@ -341,6 +666,10 @@ int main(int argv, char *argc[]) {
 
 	if (!init_libgcrypt()) return EXIT_FAILURE;
 
+	RollupCache rollups;
+	rollups.length = 0;
+	rollups.items = NULL;
+
 	for (size_t i = 0; i < args_list.length; i++) {
 		Arguments *args_item = &args_list.args_items[i];
 		if (!args_item) die("item in args list was NULL?", EXIT_FAILURE);
@@ -352,25 +681,49 @@ int main(int argv, char *argc[]) {
 			if (!new_file) fclose(test);
 		}
 
-		LogFile *file;
+		RollupCacheItem *rollup = rollup_cache_get(&rollups,
+			args_item->log_file, args_item->given_token, new_file);
+		if (!new_file && !rollup->maintained) {
+			// the log couldn't be read back in full (and why was printed),
+			// so it's not to be trusted with more events either
+			free(args_item->entry.person.name);
+			rollup_cache_finish(&rollups);
+			exit(EXIT_FAILURE);
+		}
+
 		if (new_file) {
 			// make the bare minimum to hold log entries
-			file = calloc(1, sizeof(LogFile));
+			LogFile *file = calloc(1, sizeof(LogFile));
 			file->entries.entry = NULL;
 			file->entries.length = 0;
-		} else {
-			file = logfile_read(args_item->log_file, args_item->given_token);
-			if (file == NULL) exit(EXIT_FAILURE);
-		}
-		// also save the token to save when we write
-		file->token_to_save = args_item->given_token;
+			file->entries.capacity = 0;
+			// also save the token to save when we write
+			file->token_to_save = args_item->given_token;
+			file->encoding = args_item->compact ? LOG_ENCODING_COMPACT
+												: LOG_ENCODING_TEXT;
 
-		logentry_push(&file->entries, args_item->entry);
-		logfile_write(args_item->log_file, file);
+			logentry_push(&file->entries, args_item->entry);
+			logfile_write(args_item->log_file, file);
+			rollup_apply(&rollup->rollup, &args_item->entry);
 
-		logfile_free(file);
+			logfile_free(file);
+		} else {
+			// existing logs are only ever extended at the end
+			rollup_cache_fetch(rollup, &args_item->entry);
+			bool appended = logfile_append(args_item->log_file,
+				args_item->given_token, &args_item->entry, 1);
+			if (appended) rollup_apply(&rollup->rollup, &args_item->entry);
+			free(args_item->entry.person.name);
+			if (!appended) {
+				// whatever made it into the logs so far still gets rolled up
+				rollup_cache_finish(&rollups);
+				exit(EXIT_FAILURE);
+			}
+		}
 	}
 
+	rollup_cache_finish(&rollups);
+
 	if (use_batch_file) free_args_batch(args_list);
 
 	return EXIT_SUCCESS;
@@ -0,0 +1,371 @@
+#include <string.h>
+
+#include "common.h"
+#include "logframe.h"
+
+#define LOGFRAME_FLAG_EMPLOYEE  0x01
+#define LOGFRAME_FLAG_DEPARTURE 0x02
+#define LOGFRAME_FLAG_GALLERY   0x04
+#define LOGFRAME_FLAGS_ALL      0x07
+
+#define VARINT_MAX 10 // bytes in the longest uint64_t
+
+static size_t varint_size(uint64_t value) {
+	size_t size = 1;
+	for (; value >= 0x80; value >>= 7) size++;
+	return size;
+}
+
+static uint64_t zigzag(uint32_t value, uint32_t previous) {
+	int64_t delta = (int64_t)value - (int64_t)previous;
+	return delta < 0 ? ((uint64_t)-delta << 1) - 1 : (uint64_t)delta << 1;
+}
+
+static void bytes_reserve(LogFrameBytes *bytes, size_t length) {
+	if (bytes->capacity - bytes->length >= length) return;
+	while (bytes->capacity - bytes->length < length)
+		bytes->capacity = bytes->capacity ? bytes->capacity * 2 : 256;
+	bytes->data = realloc(bytes->data, bytes->capacity);
+	if (bytes->data == NULL) die("failed to allocate log frame", 1);
+}
+
+static void bytes_push(LogFrameBytes *bytes, const void *data, size_t length) {
+	if (length == 0) return; // empty columns may not be allocated yet
+	bytes_reserve(bytes, length);
+	memcpy(&bytes->data[bytes->length], data, length);
+	bytes->length += length;
+}
+
+static void bytes_push_varint(LogFrameBytes *bytes, uint64_t value) {
+	bytes_reserve(bytes, VARINT_MAX);
+	for (; value >= 0x80; value >>= 7)
+		bytes->data[bytes->length++] = (uint8_t)(value | 0x80);
+	bytes->data[bytes->length++] = (uint8_t)value;
+}
+
+// Reads a varint from [iter, end). Returns what follows it, or NULL if it's
+// truncated or too big.
+static const uint8_t *varint_read(
+	const uint8_t *iter, const uint8_t *end, uint64_t *out) {
+	*out = 0;
+	for (int shift = 0; iter < end && shift < 64; shift += 7) {
+		uint8_t byte = *iter++;
+		if (shift == 63 && byte > 1) return NULL;
+		*out |= (uint64_t)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) return iter;
+	}
+	return NULL;
+}
+
+void logframe_writer_init(LogFrameWriter *writer) {
+	memset(writer, 0, sizeof(*writer));
+}
+
+void logframe_writer_free(LogFrameWriter *writer) {
+	free(writer->names);
+	free(writer->name_bytes.data);
+	free(writer->flags.data);
+	free(writer->timestamps.data);
+	free(writer->persons.data);
+	free(writer->rooms.data);
+	free(writer->out.data);
+	logframe_writer_init(writer);
+}
+
+static uint8_t logframe_flags(const LogEntry *entry) {
+	uint8_t flags = 0;
+	if (entry->person.role == LOG_ROLE_EMPLOYEE)
+		flags |= LOGFRAME_FLAG_EMPLOYEE;
+	if (entry->event == LOG_EVENT_DEPARTURE) flags |= LOGFRAME_FLAG_DEPARTURE;
+	if (entry->room_id == UINT32_MAX) flags |= LOGFRAME_FLAG_GALLERY;
+	return flags;
+}
+
+// Finds the slot for a name: either the one holding it, or the empty one it
+// would go in
+static uint32_t *logframe_slot(LogFrameWriter *writer, const char *name) {
+	uint32_t hash = 2166136261u; // fnv-1a
+	for (const char *iter = name; *iter != '\0'; iter++)
+		hash = (hash ^ (uint8_t)*iter) * 16777619u;
+
+	for (uint32_t i = hash;; i++) {
+		uint32_t *slot = &writer->slots[i % LOGFRAME_NAME_SLOTS];
+		if (*slot == 0 || strcmp(writer->names[*slot - 1], name) == 0)
+			return slot;
+	}
+}
+
+// how big a frame with columns of these lengths is, not counting its
+// leading length
+static size_t logframe_contents_size(size_t records_num, size_t names_num,
+	size_t name_bytes, size_t flags, size_t timestamps, size_t persons,
+	size_t rooms) {
+	return varint_size(records_num) + varint_size(names_num) +
+		varint_size(flags) + varint_size(timestamps) + varint_size(persons) +
+		name_bytes + flags + timestamps + persons + rooms;
+}
+
+// length of the flags column once the current run is written out
+static size_t logframe_flags_length(const LogFrameWriter *writer) {
+	if (writer->records_num == 0) return 0;
+	return writer->flags.length + 1 + varint_size(writer->run_length);
+}
+
+static size_t logframe_contents(const LogFrameWriter *writer) {
+	return logframe_contents_size(writer->records_num, writer->names_num,
+		writer->name_bytes.length, logframe_flags_length(writer),
+		writer->timestamps.length, writer->persons.length,
+		writer->rooms.length);
+}
+
+size_t logframe_size(const LogFrameWriter *writer) {
+	size_t contents = logframe_contents(writer);
+	return varint_size(contents) + contents;
+}
+
+bool logframe_add(LogFrameWriter *writer, const LogEntry *entry) {
+	const char *name = entry->person.name;
+	size_t name_length = strlen(name);
+	uint32_t *slot = logframe_slot(writer, name);
+	size_t person = *slot != 0 ? *slot - 1 : writer->names_num;
+	uint8_t flags = logframe_flags(entry);
+	bool first = writer->records_num == 0;
+	bool new_run = first || flags != writer->run_flags;
+	uint64_t timestamp = first
+		? entry->timestamp
+		: zigzag(entry->timestamp, writer->last_timestamp);
+
+	// work out the size first, so nothing needs undoing if it doesn't fit
+	size_t flags_length = new_run
+		? logframe_flags_length(writer) + 1 + varint_size(1)
+		: writer->flags.length + 1 + varint_size(writer->run_length + 1);
+	size_t contents = logframe_contents_size(writer->records_num + 1,
+		writer->names_num + (*slot == 0),
+		writer->name_bytes.length +
+			(*slot == 0 ? varint_size(name_length) + name_length : 0),
+		flags_length, writer->timestamps.length + varint_size(timestamp),
+		writer->persons.length + varint_size(person),
+		writer->rooms.length +
+			(entry->room_id != UINT32_MAX ? varint_size(entry->room_id) : 0));
+	if (!first && varint_size(contents) + contents > LOGFRAME_ALIGN)
+		return false;
+
+	if (*slot == 0) {
+		if (writer->names_num == writer->names_capacity) {
+			writer->names_capacity =
+				writer->names_capacity ? writer->names_capacity * 2 : 64;
+			writer->names = realloc(
+				writer->names, writer->names_capacity * sizeof(char *));
+			if (writer->names == NULL) die("failed to allocate log frame", 1);
+		}
+		writer->names[writer->names_num++] = name;
+		*slot = (uint32_t)writer->names_num;
+		bytes_push_varint(&writer->name_bytes, name_length);
+		bytes_push(&writer->name_bytes, name, name_length);
+	}
+
+	if (new_run && !first) {
+		bytes_push(&writer->flags, &writer->run_flags, 1);
+		bytes_push_varint(&writer->flags, writer->run_length);
+	}
+	writer->run_flags = flags;
+	writer->run_length = new_run ? 1 : writer->run_length + 1;
+
+	bytes_push_varint(&writer->timestamps, timestamp);
+	bytes_push_varint(&writer->persons, person);
+	if (entry->room_id != UINT32_MAX)
+		bytes_push_varint(&writer->rooms, entry->room_id);
+	writer->last_timestamp = entry->timestamp;
+	writer->records_num++;
+	return true;
+}
+
+const uint8_t *logframe_finish(LogFrameWriter *writer, size_t *out_length) {
+	LogFrameBytes *out = &writer->out;
+	size_t contents = logframe_contents(writer);
+	if (writer->records_num > 0) {
+		bytes_push(&writer->flags, &writer->run_flags, 1);
+		bytes_push_varint(&writer->flags, writer->run_length);
+	}
+
+	out->length = 0;
+	bytes_reserve(out, varint_size(contents) + contents);
+	bytes_push_varint(out, contents);
+	bytes_push_varint(out, writer->records_num);
+	bytes_push_varint(out, writer->names_num);
+	bytes_push_varint(out, writer->flags.length);
+	bytes_push_varint(out, writer->timestamps.length);
+	bytes_push_varint(out, writer->persons.length);
+	bytes_push(out, writer->name_bytes.data, writer->name_bytes.length);
+	bytes_push(out, writer->flags.data, writer->flags.length);
+	bytes_push(out, writer->timestamps.data, writer->timestamps.length);
+	bytes_push(out, writer->persons.data, writer->persons.length);
+	bytes_push(out, writer->rooms.data, writer->rooms.length);
+
+	writer->records_num = 0;
+	writer->names_num = 0;
+	memset(writer->slots, 0, sizeof(writer->slots));
+	writer->name_bytes.length = 0;
+	writer->flags.length = 0;
+	writer->timestamps.length = 0;
+	writer->persons.length = 0;
+	writer->rooms.length = 0;
+
+	*out_length = out->length;
+	return out->data;
+}
+
+void logframe_reader_init(LogFrameReader *reader) {
+	memset(reader, 0, sizeof(*reader));
+}
+
+void logframe_reader_free(LogFrameReader *reader) {
+	free(reader->names);
+	logframe_reader_init(reader);
+}
+
+// Reads a frame's leading length. Returns where the frame's contents end, or
+// NULL if that's past `end`.
+static const uint8_t *logframe_extent(
+	const char *begin, const char *end, const uint8_t **out_contents) {
+	uint64_t length;
+	const uint8_t *contents = varint_read(
+		(const uint8_t *)begin, (const uint8_t *)end, &length);
+	if (contents == NULL || length == 0 ||
+		length > (uint64_t)((const uint8_t *)end - contents))
+		return NULL;
+	*out_contents = contents;
+	return contents + length;
+}
+
+const char *logframe_skip(
+	const char *begin, const char *end, const char **out_next) {
+	const uint8_t *contents;
+	const uint8_t *frame_end = logframe_extent(begin, end, &contents);
+	if (frame_end == NULL) return "frame is truncated";
+
+	// the padding runs to the next block, or to the end of the body
+	size_t used = (const char *)frame_end - begin;
+	size_t padded =
+		(used + LOGFRAME_ALIGN - 1) / LOGFRAME_ALIGN * LOGFRAME_ALIGN;
+	const char *next = (size_t)(end - begin) < padded ? end : begin + padded;
+	for (const char *iter = (const char *)frame_end; iter < next; iter++) {
+		if (*iter != '\0') return "frame has junk in its padding";
+	}
+	*out_next = next;
+	return NULL;
+}
+
+const char *logframe_open(LogFrameReader *reader, const char *begin,
+	const char *end, const char **out_next) {
+	const char *msg = logframe_skip(begin, end, out_next);
+	if (msg != NULL) return msg;
+
+	const uint8_t *iter = NULL;
+	const uint8_t *frame_end = logframe_extent(begin, end, &iter);
+	if (frame_end == NULL) return "frame is truncated";
+	uint64_t records_num, names_num, flags, timestamps, persons;
+	if ((iter = varint_read(iter, frame_end, &records_num)) == NULL ||
+		(iter = varint_read(iter, frame_end, &names_num)) == NULL ||
+		(iter = varint_read(iter, frame_end, &flags)) == NULL ||
+		(iter = varint_read(iter, frame_end, &timestamps)) == NULL ||
+		(iter = varint_read(iter, frame_end, &persons)) == NULL)
+		return "frame has a malformed header";
+	// every record and every name takes up at least a byte
+	if (records_num == 0 || records_num > (uint64_t)(frame_end - iter) ||
+		names_num > records_num)
+		return "frame has a malformed header";
+
+	if (names_num > reader->names_capacity) {
+		reader->names_capacity = names_num;
+		reader->names =
+			realloc(reader->names, names_num * sizeof(LogFrameName));
+		if (reader->names == NULL) die("failed to allocate log frame", 1);
+	}
+	for (size_t i = 0; i < names_num; i++) {
+		uint64_t length;
+		iter = varint_read(iter, frame_end, &length);
+		if (iter == NULL || length == 0 ||
+			length > (uint64_t)(frame_end - iter) ||
+			memchr(iter, '\0', length) != NULL)
+			return "frame has a malformed name";
+		reader->names[i].name = (const char *)iter;
+		reader->names[i].length = length;
+		iter += length;
+	}
+
+	if (flags > (uint64_t)(frame_end - iter) ||
+		timestamps > (uint64_t)(frame_end - iter) - flags ||
+		persons > (uint64_t)(frame_end - iter) - flags - timestamps)
+		return "frame has malformed columns";
+	reader->flags = iter;
+	reader->flags_end = reader->timestamps = iter + flags;
+	reader->timestamps_end = reader->persons = reader->timestamps + timestamps;
+	reader->persons_end = reader->rooms = reader->persons + persons;
+	reader->rooms_end = frame_end;
+
+	reader->records_num = records_num;
+	reader->records_read = 0;
+	reader->names_num = names_num;
+	reader->run_left = 0;
+	reader->last_timestamp = 0;
+	return NULL;
+}
+
+const char *logframe_next(LogFrameReader *reader, LogFrameRecord *out) {
+	if (reader->records_read == reader->records_num)
+		return "frame has no more records";
+
+	if (reader->run_left == 0) {
+		if (reader->flags == reader->flags_end) return "frame is missing flags";
+		reader->run_flags = *reader->flags++;
+		reader->flags =
+			varint_read(reader->flags, reader->flags_end, &reader->run_left);
+		if (reader->flags == NULL || reader->run_left == 0 ||
+			(reader->run_flags & ~LOGFRAME_FLAGS_ALL) != 0)
+			return "frame has malformed flags";
+	}
+	reader->run_left--;
+
+	uint64_t timestamp, person, room_id = UINT32_MAX;
+	reader->timestamps = varint_read(
+		reader->timestamps, reader->timestamps_end, &timestamp);
+	if (reader->timestamps == NULL) return "frame has a malformed timestamp";
+	if (reader->records_read > 0) {
+		// undo the zigzag
+		int64_t delta = timestamp & 1 ? -(int64_t)((timestamp + 1) >> 1)
+									  : (int64_t)(timestamp >> 1);
+		timestamp = (uint64_t)((int64_t)reader->last_timestamp + delta);
+	}
+	if (timestamp > UINT32_MAX) return "frame has a malformed timestamp";
+
+	reader->persons =
+		varint_read(reader->persons, reader->persons_end, &person);
+	if (reader->persons == NULL || person >= reader->names_num)
+		return "frame has a malformed person";
+
+	if ((reader->run_flags & LOGFRAME_FLAG_GALLERY) == 0) {
+		reader->rooms = varint_read(reader->rooms, reader->rooms_end, &room_id);
+		if (reader->rooms == NULL || room_id >= UINT32_MAX)
+			return "frame has a malformed room id";
+	}
+
+	out->timestamp = (uint32_t)timestamp;
+	out->room_id = (uint32_t)room_id;
+	out->role = reader->run_flags & LOGFRAME_FLAG_EMPLOYEE ? LOG_ROLE_EMPLOYEE
+														   : LOG_ROLE_GUEST;
+	out->event = reader->run_flags & LOGFRAME_FLAG_DEPARTURE
+		? LOG_EVENT_DEPARTURE
+		: LOG_EVENT_ARRIVAL;
+	out->person = (size_t)person;
+	reader->last_timestamp = out->timestamp;
+
+	// every column has to come out even with the last record
+	if (++reader->records_read == reader->records_num &&
+		(reader->run_left != 0 || reader->flags != reader->flags_end ||
+			reader->timestamps != reader->timestamps_end ||
+			reader->persons != reader->persons_end ||
+			reader->rooms != reader->rooms_end))
+		return "frame has trailing bytes";
+	return NULL;
+}
@@ -1,23 +1,60 @@
-#include <stdlib.h> // -> EXIT_*
+#define _POSIX_C_SOURCE 200809L // -> glob
+
+#include <stdlib.h> // -> EXIT_*, qsort
 #include <stdio.h>  // -> printf
+#include <glob.h>
+#include <errno.h>
 
 #include "common.h"
 #include "logutils.h"
+#include "rollup.h"
 
 // Macro for printing out correct program usage
 #define logread_print_usage() \
 	printf( \
-		"logread usage:\n logread -K <token> -S <log>\n logread -K <token> " \
-		"-R (-E <name> | -G <name>) <log>\n")
+		"logread usage:\n logread -K <token> -S [-T <from> <to>] [-W <room>] " \
+		"<log>...\n" \
+		" logread -K <token> -R (-E <name> | -G <name>) [-T <from> <to>] " \
+		"[-W <room>] <log>...\n" \
+		" logread -K <token> -O <log>...\n" \
+		" each <log> may be a glob, and is read with the -K before it\n" \
+		" -T only keeps events from <from> to <to>, inclusive\n" \
+		" -W only keeps events in room <room>, or at the gallery's own doors " \
+		"for -W gallery\n")
+
+// One log to read, and what reading it turned up
+typedef struct {
+	char *logname;
+	char *token;
+	const LogFilter *filter; // NULL to keep every record
+	LogFile *log; // NULL until loaded, or if loading failed
+	char *messages; // what loading it printed, NULL until loaded
+} LogSource;
+
+// Logs being loaded side by side, and the threads each one gets to itself
+typedef struct {
+	LogSource *logs;
+	size_t threads_num;
+} LogLoadJobs;
 
 // Stores configuration for the program passed to it through arguments
 typedef struct {
-	char *token;
-	char *logname;
-	int mode; // 0 for -S mode, 1 for -R mode
+	size_t logs_num;
+	LogSource *logs;
+	int mode; // 0 for -S mode, 1 for -R mode, 2 for -O mode
 	LogPerson person;
+	LogFilter filter; // what -R and -T are after, tested before decoding
+	bool time_range;  // whether -T was given
+	bool room;        // whether -W was given
 } arguments;
 
+// One entry of the merged output, pointing back at the log it came from
+typedef struct {
+	LogSource *source;
+	LogEntry *entry;
+	size_t index; // position within its own log
+} LogRow;
+
 char *person_role_str(LogPersonRole role) {
 	return role == LOG_ROLE_EMPLOYEE ? "employee"
 		: role == LOG_ROLE_GUEST     ? "guest"
@@ -30,95 +67,361 @@ char *event_type_str(LogEventType event) {
 									   : "invalid";
 }
 
+// Prints the "[index]" tag of a row, naming its log when there's several
+static void print_row_tag(LogRow *row, bool show_source) {
+	if (show_source) printf("[%s:%i] ", row->source->logname, (int)row->index);
+	else printf("[%i] ", (int)row->index);
+}
+
 // Prints out all entries in a log nicely
 // Side effects: prints to screen
-void printLog(LogEntryList *logEntries, int n_entries) {
+void printLog(LogRow *rows, size_t n_rows, bool show_source) {
 	printf("\nLOG CONTAINS:\n\n");
 
-	for (int i = 0; i < n_entries; i++) {
-		LogEntry *current = &logEntries->entry[i];
+	for (size_t i = 0; i < n_rows; i++) {
+		LogEntry *current = rows[i].entry;
 
 		char *role = person_role_str(current->person.role);
 		char *event = event_type_str(current->event);
 
+		print_row_tag(&rows[i], show_source);
 		if (current->room_id != UINT32_MAX) {
-			printf("[%i] At %i in room %i, %s %s %s\n", i, current->timestamp,
+			printf("At %i in room %i, %s %s %s\n", current->timestamp,
 				current->room_id, role, current->person.name, event);
 		} else {
-			printf("[%i] At %i, %s %s %s the gallery\n", i, current->timestamp,
-				role, current->person.name, event);
+			printf("At %i, %s %s %s the gallery\n", current->timestamp, role,
+				current->person.name, event);
 		}
 	}
 }
 
 // Finds and prints all records in a log associated with a given LogPerson
 // Side effects: prints to screen
-void findPerson(LogEntryList *logEntries, LogPerson person, int n_entries) {
+void findPerson(
+	LogRow *rows, size_t n_rows, LogPerson person, bool show_source) {
 	char *role = person_role_str(person.role);
 	int name_len = strlen(person.name);
 
 	printf("\nLOG ENTRIES WITH %s '%s':\n\n", role, person.name);
 
-	for (int i = 0; i < n_entries; i++) {
-		LogEntry *current = &logEntries->entry[i];
+	for (size_t i = 0; i < n_rows; i++) {
+		LogEntry *current = rows[i].entry;
 		LogPerson *cPerson = &current->person;
 
 		char *event = event_type_str(current->event);
 
 		if (strncmp(person.name, cPerson->name, name_len) == 0 &&
 			cPerson->role == person.role) {
-			printf("[%i] %i, %i, %s %s %s\n", i, current->timestamp,
-				current->room_id, role, current->person.name, event);
+			print_row_tag(&rows[i], show_source);
+			printf("%i, %i, %s %s %s\n", current->timestamp, current->room_id,
+				role, current->person.name, event);
 		}
 	}
 }
 
-// Parse arguments provided to program
-// Returns 0 on success, 1 on failure
-// Side effects: modifies the arguments struct passed to it
-int logread_parse_args(int argv, char *argc[], arguments *args) {
-	if (strncmp(argc[1], "-K", 2) != 0) return 1; // Ensures are 1 == "-K"
-	if (strncmp(argc[2], "", 1) <= 0)
-		return 1; // Checks if arg 2 is empty or not
+static void print_room_name(uint32_t room_id) {
+	if (room_id == ROLLUP_GALLERY) printf("gallery");
+	else printf("room %u", room_id);
+}
 
-	args->token = duplicate_string(argc[2]);
+// the gallery as a whole goes first, then rooms by id
+static int room_id_compare(uint32_t a, uint32_t b) {
+	if (a == b) return 0;
+	if (a == ROLLUP_GALLERY || b == ROLLUP_GALLERY)
+		return a == ROLLUP_GALLERY ? -1 : 1;
+	return a < b ? -1 : 1;
+}
 
-	args->person.name = NULL;
+static int room_compare(const void *a, const void *b) {
+	return room_id_compare(
+		((RollupRoom *)a)->room_id, ((RollupRoom *)b)->room_id);
+}
+
+static int cell_compare(const void *a_ptr, const void *b_ptr) {
+	RollupCell *a = (RollupCell *)a_ptr, *b = (RollupCell *)b_ptr;
+	int by_room = room_id_compare(a->room_id, b->room_id);
+	if (by_room != 0) return by_room;
+	return a->bucket < b->bucket ? -1 : a->bucket > b->bucket;
+}
+
+static int person_compare(const void *a_ptr, const void *b_ptr) {
+	GalleryPerson *a = *(GalleryPerson **)a_ptr, *b = *(GalleryPerson **)b_ptr;
+	if (a->role != b->role) return a->role == LOG_ROLE_EMPLOYEE ? -1 : 1;
+	return strcmp(a->name, b->name);
+}
+
+// Prints occupancy figures for a log straight from its rollup, only going
+// through the log's events if the rollup is missing or out of date
+// Returns false if the log couldn't be read
+// Side effects: prints to screen
+bool printOccupancy(LogSource *source) {
+	MerkleHash log_mac;
+	if (!logfile_root_mac(source->logname, source->token, &log_mac))
+		return false;
+
+	Rollup rollup;
+	const char *msg =
+		rollup_load(&rollup, source->logname, source->token, &log_mac);
+	if (msg != NULL) {
+		printf("Rebuilding occupancy from log '%s': %s\n", source->logname,
+			msg);
+		rollup_free(&rollup);
+		if (!rollup_rebuild(&rollup, source->logname, source->token))
+			return false;
+	}
+
+	printf("\nOCCUPANCY IN '%s' (%llu events, buckets of %u):\n\n",
+		source->logname, (unsigned long long)rollup.events,
+		rollup.bucket_width);
+
+	printf("Peak concurrent guests: %u at %u (now %u)\n", rollup.guests_peak,
+		rollup.guests_peak_at, rollup.guests_now);
+
+	qsort(rollup.rooms, rollup.rooms_num, sizeof(RollupRoom), room_compare);
+	printf("\nRooms:\n");
+	for (size_t i = 0; i < rollup.rooms_num; i++) {
+		RollupRoom *room = &rollup.rooms[i];
+		printf(" ");
+		print_room_name(room->room_id);
+		printf(": %u now, peak %u at %u\n", room->count, room->peak,
+			room->peak_at);
+	}
+
+	// buckets without events don't get stored, but people can still be
+	// inside through them. those are filled in from the bucket before.
+	qsort(rollup.cells, rollup.cells_num, sizeof(RollupCell), cell_compare);
+	printf("\nOccupancy per bucket:\n");
+	for (size_t i = 0; i < rollup.cells_num; i++) {
+		RollupCell *cell = &rollup.cells[i];
+		RollupCell *prev = i > 0 ? &rollup.cells[i - 1] : NULL;
+		if (prev != NULL && prev->room_id == cell->room_id && prev->end > 0) {
+			uint64_t b = (uint64_t)prev->bucket + 1;
+			for (; b < cell->bucket; b++) {
+				printf(" ");
+				print_room_name(cell->room_id);
+				printf(" [%llu, %llu): peak %u, 0 arrivals\n",
+					(unsigned long long)b * rollup.bucket_width,
+					(unsigned long long)(b + 1) * rollup.bucket_width,
+					prev->end);
+			}
+		}
+
+		printf(" ");
+		print_room_name(cell->room_id);
+		printf(" [%llu, %llu): peak %u, %u arrivals\n",
+			(unsigned long long)cell->bucket * rollup.bucket_width,
+			(unsigned long long)(cell->bucket + 1) * rollup.bucket_width,
+			cell->peak, cell->arrivals);
+	}
+
+	GalleryPerson **people =
+		malloc((rollup.people.length + 1) * sizeof(GalleryPerson *));
+	if (people == NULL) die("failed to allocate people list", 1);
+	size_t people_num = 0;
+	for (size_t i = 0; i < rollup.people.capacity; i++) {
+		if (rollup.people.slots[i].name != NULL)
+			people[people_num++] = &rollup.people.slots[i];
+	}
+	qsort(people, people_num, sizeof(GalleryPerson *), person_compare);
+
+	printf("\nTime in gallery:\n");
+	for (size_t i = 0; i < people_num; i++) {
+		printf(" %s %s: %llu%s\n", person_role_str(people[i]->role),
+			people[i]->name,
+			(unsigned long long)rollup_time_inside(&rollup, people[i]),
+			people[i]->location != GALLERY_OUTSIDE ? " (still inside)" : "");
+	}
 
-	// -S is exclusive, if it is found, we return
-	if (strncmp(argc[3], "-S", 2) == 0) {
-		args->mode = 0;
+	free(people);
+	rollup_free(&rollup);
+	return true;
+}
 
-		if (strncmp(argc[4], "", 1) <= 0) return 1;
-		args->logname = duplicate_string(argc[4]);
+// Orders rows by timestamp, then by the order the logs were given in, then by
+// position in their log, so the merge is deterministic
+static int row_compare(const void *a_ptr, const void *b_ptr) {
+	LogRow *a = (LogRow *)a_ptr, *b = (LogRow *)b_ptr;
+	uint32_t a_time = a->entry->timestamp, b_time = b->entry->timestamp;
+	if (a_time != b_time) return a_time < b_time ? -1 : 1;
+	if (a->source != b->source) return a->source < b->source ? -1 : 1;
+	if (a->index != b->index) return a->index < b->index ? -1 : 1;
+	return 0;
+}
 
-		return 0;
+// Merges the entries of every log that loaded into one timestamp-ordered list
+// Returns a malloc'd array, stores its length in `out_length`
+LogRow *merge_logs(arguments *args, size_t *out_length) {
+	size_t total = 0;
+	for (size_t i = 0; i < args->logs_num; i++) {
+		if (args->logs[i].log != NULL)
+			total += args->logs[i].log->entries.length;
 	}
 
-	args->mode = 1;
+	LogRow *rows = malloc((total + 1) * sizeof(LogRow));
+	if (rows == NULL) die("failed to allocate merged log", 1);
+
+	size_t length = 0;
+	for (size_t i = 0; i < args->logs_num; i++) {
+		LogSource *source = &args->logs[i];
+		if (source->log == NULL) continue;
+		LogFile *log = source->log;
+		for (size_t j = 0; j < log->entries.length; j++) {
+			rows[length].source = source;
+			rows[length].entry = &log->entries.entry[j];
+			rows[length].index = log->ordinals ? log->ordinals[j] : j;
+			length++;
+		}
+	}
 
-	// In -R mode, we must have 6 options
-	if (argv != 7) return 1;
+	// a single log is already in order, no need to sort it
+	if (args->logs_num > 1) qsort(rows, length, sizeof(LogRow), row_compare);
 
-	// If arg 3 isn't -R or -S, something is wrong
-	if (strncmp(argc[3], "-R", 2) != 0) return 1;
+	*out_length = length;
+	return rows;
+}
 
-	if (strncmp(argc[4], "-E", 2) == 0) {
-		args->person.role = LOG_ROLE_EMPLOYEE;
-	} else if (strncmp(argc[4], "-G", 2) == 0) {
-		args->person.role = LOG_ROLE_GUEST;
-	} else
-		return 1;
+// Loads one log. Whatever it prints is held back, so every log's messages
+// come out together, in order, once they're all loaded.
+static void load_log_job(void *context, size_t job) {
+	LogLoadJobs *jobs = context;
+	LogSource *source = &jobs->logs[job];
+
+	size_t messages_length;
+	FILE *messages = open_memstream(&source->messages, &messages_length);
+	if (messages == NULL) die("couldn't buffer log messages", 1);
+
+	LogReadOptions options;
+	options.threads_num = jobs->threads_num;
+	options.messages = messages;
+	source->log = logfile_read_with(
+		source->logname, source->token, source->filter, &options);
+	fclose(messages);
+}
 
-	if (strncmp(argc[5], "", 1) <= 0) return 1;
-	args->person.name = duplicate_string(argc[5]);
+// Adds a log to the arguments, or every log matching it if it's a glob
+// Side effects: modifies the arguments struct passed to it
+void logread_add_logs(arguments *args, char *pattern, char *token) {
+	glob_t matches;
+	// no match leaves the pattern itself, which then fails to open on its own
+	if (glob(pattern, GLOB_NOCHECK, NULL, &matches) != 0)
+		die("couldn't expand log name", 1);
+
+	args->logs = realloc(
+		args->logs, (args->logs_num + matches.gl_pathc) * sizeof(LogSource));
+	if (args->logs == NULL) die("failed to allocate log list", 1);
+
+	for (size_t i = 0; i < matches.gl_pathc; i++) {
+		// a glob like `gallery*` also picks up each log's sidecars
+		bool expanded = strcmp(matches.gl_pathv[i], pattern) != 0;
+		if (expanded && logfile_is_sidecar(matches.gl_pathv[i])) continue;
+
+		LogSource *source = &args->logs[args->logs_num++];
+		source->logname = duplicate_string(matches.gl_pathv[i]);
+		source->token = duplicate_string(token);
+		source->filter = NULL;
+		source->log = NULL;
+		source->messages = NULL;
+	}
 
-	if (strncmp(argc[6], "", 1) <= 0) return 1;
-	args->logname = duplicate_string(argc[6]);
+	globfree(&matches);
+}
+
+// Reads a decimal timestamp or room id
+// Returns false if it's malformed
+static bool parse_number(const char *arg, uint32_t *out) {
+	char *tail;
+	errno = 0;
+	unsigned long value = strtoul(arg, &tail, 10);
+	if (arg[0] < '0' || arg[0] > '9' || *tail != '\0' || errno != 0 ||
+		value > UINT32_MAX)
+		return false;
+	*out = (uint32_t)value;
+	return true;
+}
+
+// Parse arguments provided to program
+// Returns 0 on success, 1 on failure
+// Side effects: modifies the arguments struct passed to it
+int logread_parse_args(int argv, char *argc[], arguments *args) {
+	args->logs_num = 0;
+	args->logs = NULL;
+	args->mode = -1;
+	args->person.name = NULL;
+	logfilter_init(&args->filter);
+	args->time_range = false;
+	args->room = false;
+
+	char *token = NULL;
+
+	for (int i = 1; i < argv; i++) {
+		if (strncmp(argc[i], "-K", 3) == 0) {
+			// -K <token>, for every log after it until the next -K
+			if (++i >= argv || strncmp(argc[i], "", 1) <= 0) return 1;
+			token = argc[i];
+		} else if (strncmp(argc[i], "-S", 3) == 0) {
+			if (args->mode != -1) return 1;
+			args->mode = 0;
+		} else if (strncmp(argc[i], "-O", 3) == 0) {
+			if (args->mode != -1) return 1;
+			args->mode = 2;
+		} else if (strncmp(argc[i], "-R", 3) == 0) {
+			// -R (-E <name> | -G <name>)
+			if (args->mode != -1 || i + 2 >= argv) return 1;
+			args->mode = 1;
+
+			if (strncmp(argc[i + 1], "-E", 3) == 0) {
+				args->person.role = LOG_ROLE_EMPLOYEE;
+			} else if (strncmp(argc[i + 1], "-G", 3) == 0) {
+				args->person.role = LOG_ROLE_GUEST;
+			} else
+				return 1;
+
+			if (strncmp(argc[i + 2], "", 1) <= 0) return 1;
+			args->person.name = duplicate_string(argc[i + 2]);
+			i += 2;
+		} else if (strncmp(argc[i], "-T", 3) == 0) {
+			// -T <from> <to>
+			if (args->time_range || i + 2 >= argv ||
+				!parse_number(argc[i + 1], &args->filter.time_from) ||
+				!parse_number(argc[i + 2], &args->filter.time_to) ||
+				args->filter.time_from > args->filter.time_to)
+				return 1;
+			args->time_range = true;
+			i += 2;
+		} else if (strncmp(argc[i], "-W", 3) == 0) {
+			// -W (<room-id> | gallery)
+			if (args->room || ++i >= argv) return 1;
+			args->filter.any_room = false;
+			if (strcmp(argc[i], "gallery") == 0)
+				args->filter.room_id = UINT32_MAX;
+			else if (!parse_number(argc[i], &args->filter.room_id))
+				return 1;
+			args->room = true;
+		} else {
+			// <log>, needs a token before it
+			if (token == NULL || strncmp(argc[i], "", 1) <= 0) return 1;
+			logread_add_logs(args, argc[i], token);
+		}
+	}
+
+	if (args->mode == -1 || args->logs_num == 0) return 1;
+	// occupancy comes from the rollups, which don't go by time or room
+	if ((args->time_range || args->room) && args->mode == 2) return 1;
 
 	return 0;
 }
 
+void logread_free_args(arguments *args) {
+	for (size_t i = 0; i < args->logs_num; i++) {
+		if (args->logs[i].log != NULL) logfile_free(args->logs[i].log);
+		free(args->logs[i].logname);
+		free(args->logs[i].token);
+		free(args->logs[i].messages);
+	}
+	free(args->logs);
+	free(args->person.name);
+}
+
 int main(int argv, char *argc[]) {
 	if (argv <= 4) {
 		printf("Not enough arguments.\n");
@@ -130,34 +433,83 @@ int main(int argv, char *argc[]) {
 	if (logread_parse_args(argv, argc, &args) != 0) {
 		printf("Error while parsing input\n");
 		logread_print_usage();
+		logread_free_args(&args);
 		return EXIT_FAILURE;
 	}
 
-	printf("Parsed args:\n Token: %s\n Logname: %s\n Person: %s\n", args.token,
-		args.logname, args.person.name);
+	printf("Parsed args:\n");
+	for (size_t i = 0; i < args.logs_num; i++) {
+		printf(" Token: %s\n Logname: %s\n", args.logs[i].token,
+			args.logs[i].logname);
+	}
+	printf(" Person: %s\n", args.person.name);
 
 	if (!init_libgcrypt()) {
 		printf("Unable to initialize libgcrypt\n");
 		return EXIT_FAILURE;
 	};
 
-	LogFile *log = logfile_read(args.logname, args.token);
-	if (log == NULL) {
-		printf("Error reading log file\n");
-		return EXIT_FAILURE;
+	// occupancy comes from the rollups, the events aren't needed at all
+	if (args.mode == 2) {
+		int status = EXIT_SUCCESS;
+		for (size_t i = 0; i < args.logs_num; i++) {
+			if (printOccupancy(&args.logs[i])) continue;
+			printf("Error reading log file '%s'\n", args.logs[i].logname);
+			status = EXIT_FAILURE;
+		}
+		logread_free_args(&args);
+		return status;
+	}
+
+	// -R only wants one person's records, and -W one room's, so the rest are
+	// skipped without being decoded. with -T, logs that have a time index are
+	// only read from where the range starts.
+	if (args.mode == 1) {
+		args.filter.name = args.person.name;
+		args.filter.role = args.person.role;
+	}
+	if (args.mode == 1 || args.time_range || args.room) {
+		for (size_t i = 0; i < args.logs_num; i++)
+			args.logs[i].filter = &args.filter;
 	}
 
-	if (args.mode == 0) {
-		printLog(&log->entries, log->entries.length);
-	} else {
-		findPerson(&log->entries, args.person, log->entries.length);
-		free(args.person.name);
+	// logs are loaded side by side, and each one splits its share of the
+	// threads between its chunks, so there's never more than one thread per
+	// core in all. a log that fails to load is reported and left out, the
+	// rest are still queried.
+	size_t threads_num = logjobs_threads();
+	size_t loaders_num =
+		args.logs_num < threads_num ? args.logs_num : threads_num;
+	LogLoadJobs jobs;
+	jobs.logs = args.logs;
+	jobs.threads_num = loaders_num > 0 ? threads_num / loaders_num : 1;
+	logjobs_run(load_log_job, &jobs, args.logs_num, loaders_num);
+
+	int status = EXIT_SUCCESS;
+	bool any_loaded = false;
+	for (size_t i = 0; i < args.logs_num; i++) {
+		if (args.logs[i].messages != NULL)
+			fputs(args.logs[i].messages, stdout);
+		any_loaded |= args.logs[i].log != NULL;
+		if (args.logs[i].log != NULL) continue;
+		printf("Error reading log file '%s'\n", args.logs[i].logname);
+		status = EXIT_FAILURE;
 	}
 
-	logfile_free(log);
+	size_t n_rows;
+	LogRow *rows = merge_logs(&args, &n_rows);
+
+	if (any_loaded) {
+		bool show_source = args.logs_num > 1;
+		if (args.mode == 0) {
+			printLog(rows, n_rows, show_source);
+		} else {
+			findPerson(rows, n_rows, args.person, show_source);
+		}
+	}
 
-	free(args.token);
-	free(args.logname);
+	free(rows);
+	logread_free_args(&args);
 
-	return EXIT_SUCCESS;
+	return status;
 }
@@ -0,0 +1,286 @@
+#include <stdlib.h> // -> EXIT_*
+#include <stdio.h>  // -> printf
+
+#include "common.h"
+#include "logutils.h"
+
+// Checks the parts of the log library the command line tools can't reach on
+// their own, such as how a big log is split between threads. Run it through
+// `make test`.
+// usage: logtest
+
+#define TEST_LOG_FILE "logtest.log"
+#define TEST_TOKEN    "test"
+
+static int failures = 0;
+
+#define check(cond, what) \
+	do { \
+		if (!(cond)) { \
+			printf(CONSOLE_VIS_ERROR "FAIL" CONSOLE_VIS_RESET \
+				" %s:%d: %s\n", __FILE__, __LINE__, what); \
+			failures++; \
+		} \
+	} while (0)
+
+// names from 3 to 12 letters, so records aren't all the same width
+static void test_name(size_t i, char *out) {
+	size_t length = 3 + i % 10;
+	for (size_t j = 0; j < length; j++, i /= 7)
+		out[j] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"[i % 52];
+	out[length] = '\0';
+}
+
+// Fills `log` with `records` made up events, in the given encoding. Names
+// come from `names`.
+static void test_entries(LogFile *log, LogEncoding encoding, size_t records,
+	char (*names)[16], size_t names_num) {
+	log->token_to_save = TEST_TOKEN;
+	log->encoding = encoding;
+	log->entries.length = records;
+	log->entries.capacity = records;
+	log->entries.entry = malloc((records + 1) * sizeof(LogEntry));
+	if (log->entries.entry == NULL) die("failed to allocate entries", 1);
+	log->records_num = records;
+	log->ordinals = NULL;
+
+	uint32_t timestamp = 0;
+	for (size_t i = 0; i < records; i++) {
+		LogEntry *entry = &log->entries.entry[i];
+		timestamp += 1 + (uint32_t)(i * 7919 % 5); // gaps, and large values
+		entry->timestamp = timestamp;
+		entry->room_id = i % 3 == 0 ? UINT32_MAX : (uint32_t)(i * 31 % 1000);
+		entry->person.name = names[i * 2654435761u % names_num];
+		entry->person.role = i % 5 == 0 ? LOG_ROLE_EMPLOYEE : LOG_ROLE_GUEST;
+		entry->event = i % 2 == 0 ? LOG_EVENT_ARRIVAL : LOG_EVENT_DEPARTURE;
+	}
+}
+
+static bool test_same_entry(const LogEntry *a, const LogEntry *b) {
+	return a->timestamp == b->timestamp && a->room_id == b->room_id &&
+		a->event == b->event && a->person.role == b->person.role &&
+		strcmp(a->person.name, b->person.name) == 0;
+}
+
+// whether two reads of a log kept the same records, from the same places
+static bool test_same_log(const LogFile *a, const LogFile *b) {
+	if (a->records_num != b->records_num ||
+		a->entries.length != b->entries.length ||
+		(a->ordinals == NULL) != (b->ordinals == NULL))
+		return false;
+	for (size_t i = 0; i < a->entries.length; i++) {
+		if (!test_same_entry(&a->entries.entry[i], &b->entries.entry[i]))
+			return false;
+		if (a->ordinals != NULL && a->ordinals[i] != b->ordinals[i])
+			return false;
+	}
+	return true;
+}
+
+static long test_file_size(const char *filename) {
+	FILE *file = fopen(filename, "rb");
+	if (file == NULL) return -1;
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fclose(file);
+	return size;
+}
+
+static LogFile *test_read(const LogFilter *filter, size_t threads_num) {
+	LogReadOptions options;
+	logreadoptions_init(&options);
+	options.threads_num = threads_num;
+	options.messages = fopen("/dev/null", "w");
+	if (options.messages == NULL) die("couldn't open /dev/null", 1);
+	LogFile *log =
+		logfile_read_with(TEST_LOG_FILE, TEST_TOKEN, filter, &options);
+	fclose(options.messages);
+	return log;
+}
+
+static void test_remove_log(void) {
+	remove(TEST_LOG_FILE);
+	remove(TEST_LOG_FILE ".merkle");
+	remove(TEST_LOG_FILE ".index");
+	remove(TEST_LOG_FILE ".rollup");
+}
+
+// Parses a log bigger than LOGFILE_PARALLEL_MIN_BODY on one thread, then on
+// several. the chunk cuts move with the thread count, and at these counts
+// they land in the middle of lines (or frames), which the chunking has to
+// push on to the next record. every read has to match the one-thread one.
+static void test_parallel_parse(LogEncoding encoding, size_t records) {
+	static char names[8192][16];
+	for (size_t i = 0; i < sizeofarr(names); i++) test_name(i, names[i]);
+
+	LogFile written;
+	test_entries(&written, encoding, records, names, sizeofarr(names));
+	logfile_write(TEST_LOG_FILE, &written);
+	check(test_file_size(TEST_LOG_FILE) > 3 << 20,
+		"log is too small to be parsed in chunks");
+
+	LogFilter by_name;
+	logfilter_init(&by_name);
+	by_name.name = names[17];
+	by_name.role = LOG_ROLE_GUEST;
+
+	LogFile *serial = test_read(NULL, 1);
+	LogFile *serial_filtered = test_read(&by_name, 1);
+	check(serial != NULL && test_same_log(serial, &written),
+		"one-thread read doesn't give back what was written");
+	check(serial_filtered != NULL && serial_filtered->entries.length > 0,
+		"filtered one-thread read kept nothing");
+
+	static const size_t threads[] = {2, 3, 5, 7, 16};
+	for (size_t i = 0; i < sizeofarr(threads); i++) {
+		LogFile *parallel = test_read(NULL, threads[i]);
+		check(parallel != NULL && serial != NULL &&
+				test_same_log(parallel, serial),
+			"chunked read differs from the one-thread read");
+		if (parallel != NULL) logfile_free(parallel);
+
+		parallel = test_read(&by_name, threads[i]);
+		check(parallel != NULL && serial_filtered != NULL &&
+				test_same_log(parallel, serial_filtered),
+			"chunked filtered read differs from the one-thread read");
+		if (parallel != NULL) logfile_free(parallel);
+	}
+
+	if (serial != NULL) logfile_free(serial);
+	if (serial_filtered != NULL) logfile_free(serial_filtered);
+	free(written.entries.entry);
+	test_remove_log();
+}
+
+// Reads a whole file into memory
+static char *test_slurp(const char *filename, size_t *out_length) {
+	FILE *file = fopen(filename, "rb");
+	if (file == NULL) return NULL;
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	char *result = malloc((size_t)size + 1);
+	if (result == NULL) die("failed to allocate test log", 1);
+	*out_length = fread(result, 1, (size_t)size, file);
+	fclose(file);
+	return result;
+}
+
+// Whether a text log's header and body are byte for byte what printf makes
+// of `entries`, which is how records were written before the serializer
+static bool test_same_text(const LogEntry *entries, size_t entries_num) {
+	size_t capacity = 64;
+	for (size_t i = 0; i < entries_num; i++)
+		capacity += strlen(entries[i].person.name) + 32;
+	char *expected = malloc(capacity);
+	if (expected == NULL) die("failed to allocate expected log", 1);
+
+	size_t length = sprintf(expected, "STARTLOG%s*", TEST_TOKEN);
+	for (size_t i = 0; i < entries_num; i++) {
+		const LogEntry *entry = &entries[i];
+		length += sprintf(&expected[length], "%x#%c%s#%c#", entry->timestamp,
+			entry->person.role, entry->person.name, entry->event);
+		if (entry->room_id != UINT32_MAX)
+			length += sprintf(&expected[length], "%u#", entry->room_id);
+		expected[length++] = '\n';
+	}
+	length += sprintf(&expected[length], "ENDLOG\n");
+
+	size_t actual_length;
+	char *actual = test_slurp(TEST_LOG_FILE, &actual_length);
+	bool same = actual != NULL && actual_length > length &&
+		memcmp(actual, expected, length) == 0;
+	free(actual);
+	free(expected);
+	return same;
+}
+
+// Writes a log, then appends to it in batches of different sizes, with
+// timestamps and room ids at every digit count and names long enough to
+// skip the writer's buffer. after each step the text has to be exactly what
+// printf would have written, and read back as what went in.
+static void test_write_round_trip(void) {
+	static const uint32_t rooms[] = {
+		UINT32_MAX, 0, 9, 10, 99, 100, 65535, 4294967294u};
+	static const size_t batches[] = {1, 3, 2000, 70000};
+	size_t first = 20000; // records in the log before the appends
+	size_t total = first;
+	for (size_t i = 0; i < sizeofarr(batches); i++) total += batches[i];
+
+	static char short_names[512][16];
+	for (size_t i = 0; i < sizeofarr(short_names); i++)
+		test_name(i, short_names[i]);
+	// past LOGWRITER_DIRECT_MIN, and a few blocks long
+	size_t long_length = 200 * 1024;
+	char *long_name = malloc(long_length + 1);
+	if (long_name == NULL) die("failed to allocate long name", 1);
+	for (size_t i = 0; i < long_length; i++) long_name[i] = "Zyx"[i % 3];
+	long_name[long_length] = '\0';
+
+	LogEntry *entries = malloc(total * sizeof(LogEntry));
+	if (entries == NULL) die("failed to allocate entries", 1);
+	for (size_t i = 0; i < total; i++) {
+		LogEntry *entry = &entries[i];
+		// every hex digit count on the way up, ending at the very last one
+		if (i + 1 == total) entry->timestamp = UINT32_MAX;
+		else if (i < 32) entry->timestamp = (uint32_t)1 << i;
+		else entry->timestamp = (1u << 31) + (uint32_t)i;
+		entry->room_id = rooms[i % sizeofarr(rooms)];
+		entry->person.name =
+			i % 9999 == 5 ? long_name : short_names[i % sizeofarr(short_names)];
+		entry->person.role = i % 3 == 0 ? LOG_ROLE_EMPLOYEE : LOG_ROLE_GUEST;
+		entry->event = i % 2 == 0 ? LOG_EVENT_ARRIVAL : LOG_EVENT_DEPARTURE;
+	}
+
+	LogFile written;
+	written.token_to_save = TEST_TOKEN;
+	written.encoding = LOG_ENCODING_TEXT;
+	written.entries.entry = entries;
+	written.entries.length = first;
+	written.entries.capacity = written.entries.length;
+	written.records_num = written.entries.length;
+	written.ordinals = NULL;
+	logfile_write(TEST_LOG_FILE, &written);
+	size_t length = first;
+	check(test_same_text(entries, length), "written log isn't as printf'd");
+
+	for (size_t i = 0; i < sizeofarr(batches); i++) {
+		check(logfile_append(
+				  TEST_LOG_FILE, TEST_TOKEN, &entries[length], batches[i]),
+			"couldn't append to the log");
+		length += batches[i];
+		check(test_same_text(entries, length),
+			"appended log isn't as printf'd");
+	}
+
+	LogFile expected = written;
+	expected.entries.length = total;
+	expected.records_num = total;
+	LogFile *read = test_read(NULL, 1);
+	check(read != NULL && test_same_log(read, &expected),
+		"log doesn't read back as written");
+	if (read != NULL) logfile_free(read);
+
+	free(entries);
+	free(long_name);
+	test_remove_log();
+}
+
+int main(void) {
+	if (!init_libgcrypt()) return EXIT_FAILURE;
+
+	printf("writing and appending...\n");
+	test_write_round_trip();
+	printf("parallel parsing, text...\n");
+	test_parallel_parse(LOG_ENCODING_TEXT, 200000);
+	printf("parallel parsing, compact...\n");
+	test_parallel_parse(LOG_ENCODING_COMPACT, 600000);
+
+	if (failures > 0) {
+		printf(CONSOLE_VIS_ERROR "%d checks failed" CONSOLE_VIS_RESET "\n",
+			failures);
+		return EXIT_FAILURE;
+	}
+	printf("all checks passed\n");
+	return EXIT_SUCCESS;
+}
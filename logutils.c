@@ -1,10 +1,22 @@
+#define _POSIX_C_SOURCE 200809L // -> pthreads, sysconf
+
 #include <stddef.h> // -> size_t, ptrdiff_t
 #include <stdio.h>
 #include <ctype.h> // -> isalnum
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h> // -> sysconf, ftruncate, lseek, close
+#include <errno.h>
+#include <fcntl.h>   // -> open
+#include <sys/uio.h> // -> writev
 
 #include "common.h"
 #include "logutils.h"
+#include "logframe.h"
+#include "merkle.h"
+#include "rollup.h"
+#include "scan.h"
+#include "timeindex.h"
 
 const char *validate_token(char *token) {
 	if (token == NULL || token[0] == '\0') return "token is required";
@@ -48,35 +60,688 @@ const char *logentry_validate(LogEntry *entry) {
 	return NULL;
 }
 
-LogFile *logfile_read(char *filename, char *given_token) {
+// logs with a body smaller than this are parsed on the calling thread, since
+// starting workers would cost more than it saves.
+#define LOGFILE_PARALLEL_MIN_BODY (1 << 20)
+// every worker gets a few chunks so one slow chunk doesn't stall the rest
+#define LOGFILE_CHUNKS_PER_THREAD 4
+#define LOGFILE_MAX_THREADS       64
+
+typedef struct {
+	char *begin, *end; // [begin, end) only ever covers whole records (frames)
+	LogEncoding encoding;
+	const LogFilter *filter; // NULL keeps every record
+	bool in_order; // stop at the first record past the filter's time range
+	bool stopped;  // whether that happened
+	LogEntryList entries;
+	size_t records_num; // records in the chunk, kept or not
+	size_t *ordinals;   // with a filter, where each entry was in the chunk
+	size_t ordinals_capacity;
+	const char *error;
+} LogChunk;
+
+typedef struct {
+	LogJobFn run;
+	void *context;
+	size_t jobs_num;
+	size_t next_job; // guarded by `lock`
+	pthread_mutex_t lock;
+} LogJobQueue;
+
+// leaves hashed per job when checking a log's integrity
+#define LOGFILE_LEAVES_PER_JOB 256
+
+typedef struct {
+	const char *body;
+	MerkleHash *leaves;
+	size_t leaves_num;
+} LogLeafJobs;
+
+// Reads all of `file` into one null-terminated buffer.
+// Returns NULL if the file couldn't be read.
+static char *read_whole_file(FILE *file, size_t *out_length) {
+	if (fseek(file, 0, SEEK_END) != 0) return NULL;
+	long size = ftell(file);
+	if (size < 0 || fseek(file, 0, SEEK_SET) != 0) return NULL;
+
+	char *result = malloc((size_t)size + 1);
+	if (result == NULL) die("failed to allocate buffer for log", 1);
+
+	*out_length = fread(result, 1, (size_t)size, file);
+	if (*out_length != (size_t)size) {
+		free(result);
+		return NULL;
+	}
+	result[*out_length] = '\0';
+
+	return result;
+}
+
+// what records are split on
+static const ScanSet record_line_end = SCANSET1('\n');
+static const ScanSet record_field_end = SCANSET1('#');
+
+// what ends the token in a log's header also says how its body is encoded
+#define LOGFILE_TEXT_MARKER    '*'
+#define LOGFILE_COMPACT_MARKER '$'
+
+static char logfile_marker(LogEncoding encoding) {
+	return encoding == LOG_ENCODING_COMPACT ? LOGFILE_COMPACT_MARKER
+											: LOGFILE_TEXT_MARKER;
+}
+
+// Returns false if `marker` isn't one
+static bool logfile_encoding_of(char marker, LogEncoding *out) {
+	if (marker != LOGFILE_TEXT_MARKER && marker != LOGFILE_COMPACT_MARKER)
+		return false;
+	*out = marker == LOGFILE_COMPACT_MARKER ? LOG_ENCODING_COMPACT
+											: LOG_ENCODING_TEXT;
+	return true;
+}
+
+// Parses the record at the start of [*cursor, end) and leaves `*cursor` just
+// past its newline. Returns an error message if the record is malformed.
+static const char *logrecord_parse(char **cursor, char *end, LogEntry *out) {
+	char *iter = *cursor;
+	char *line_end = (char *)scan_find(&record_line_end, iter, end);
+	if (line_end == end) return "record is missing its line terminator";
+
+	// Read timestamp (hex)
+	uint32_t timestamp = 0;
+	char *digits_start = iter;
+	for (; iter < line_end && isxdigit((unsigned char)*iter); iter++) {
+		char c = *iter;
+		uint32_t digit = c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+		timestamp = (timestamp << 4) | digit;
+	}
+	if (iter == digits_start || iter - digits_start > 8 || *iter++ != '#')
+		return "record has a malformed timestamp";
+
+	// Read employee-name | guest-name
+	LogPerson person;
+	person.role = *iter++;
+	if (person.role != LOG_ROLE_EMPLOYEE && person.role != LOG_ROLE_GUEST)
+		return "record has an unknown person role";
+	char *name_start = iter;
+	iter = (char *)scan_find(&record_field_end, iter, line_end);
+	if (iter == name_start || iter == line_end)
+		return "record has a malformed name";
+	size_t name_len = iter++ - name_start;
+
+	// Read arrival | departure
+	LogEventType event = *iter++;
+	if (event != LOG_EVENT_ARRIVAL && event != LOG_EVENT_DEPARTURE)
+		return "record has an unknown event type";
+	if (iter >= line_end || *iter++ != '#')
+		return "record has a malformed event type";
+
+	// Optional: room-id (decimal)
+	uint32_t room_id = UINT32_MAX;
+	if (iter != line_end) {
+		digits_start = iter;
+		uint64_t value = 0;
+		for (; iter < line_end && isdigit((unsigned char)*iter); iter++) {
+			value = value * 10 + (*iter - '0');
+			if (value > UINT32_MAX) return "record has an oversized room id";
+		}
+		if (iter == digits_start || *iter++ != '#' || iter != line_end)
+			return "record has a malformed room id";
+		room_id = (uint32_t)value;
+	}
+
+	person.name = malloc(name_len + 1);
+	if (person.name == NULL) die("failed to allocate name", 1);
+	memcpy(person.name, name_start, name_len);
+	person.name[name_len] = '\0';
+
+	out->timestamp = timestamp;
+	out->room_id = room_id;
+	out->person = person;
+	out->event = event;
+
+	*cursor = line_end + 1;
+	return NULL;
+}
+
+void logfilter_init(LogFilter *filter) {
+	filter->name = NULL;
+	filter->role = LOG_ROLE_GUEST;
+	filter->any_room = true;
+	filter->room_id = UINT32_MAX;
+	filter->time_from = 0;
+	filter->time_to = UINT32_MAX;
+}
+
+// Reads the hex timestamp in [iter, separator), the first field of a raw
+// record. Returns false if it's malformed.
+static bool logrecord_timestamp(
+	const char *iter, const char *separator, uint32_t *out) {
+	if (iter == separator || separator - iter > 8) return false;
+	uint32_t timestamp = 0;
+	for (; iter < separator; iter++) {
+		char c = *iter;
+		if (!isxdigit((unsigned char)c)) return false;
+		uint32_t digit = c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+		timestamp = (timestamp << 4) | digit;
+	}
+	*out = timestamp;
+	return true;
+}
+
+// Tests a raw record in [iter, line_end) against a filter without decoding
+// it. Records that are too broken to tell count as matching, so the parser
+// still gets to report them. For anything well-formed the answer is the one
+// the decoded record would get, names matching by prefix like -R always has.
+static bool logrecord_matches(
+	const char *iter, const char *line_end, const LogFilter *filter) {
+	const char *separator = scan_find(&record_field_end, iter, line_end);
+	if (separator == line_end) return true;
+
+	uint32_t timestamp;
+	if (filter->time_from > 0 || filter->time_to < UINT32_MAX) {
+		if (!logrecord_timestamp(iter, separator, &timestamp)) return true;
+		if (timestamp < filter->time_from || timestamp > filter->time_to)
+			return false;
+	}
+	iter = separator + 1;
+
+	if (iter >= line_end) return true;
+	LogPersonRole role = *iter++;
+	if (role != LOG_ROLE_EMPLOYEE && role != LOG_ROLE_GUEST) return true;
+	if (filter->name != NULL) {
+		size_t name_len = strlen(filter->name);
+		if (role != filter->role || (size_t)(line_end - iter) < name_len ||
+			memcmp(iter, filter->name, name_len) != 0)
+			return false;
+	}
+
+	if (!filter->any_room) {
+		// skip the name and the event to get to the optional room id
+		separator = scan_find(&record_field_end, iter, line_end);
+		if (line_end - separator < 3) return true;
+		iter = separator + 3;
+
+		uint64_t room_id = UINT32_MAX;
+		if (iter < line_end) {
+			room_id = 0;
+			for (; iter < line_end && *iter != '#'; iter++) {
+				if (!isdigit((unsigned char)*iter)) return true;
+				room_id = room_id * 10 + (*iter - '0');
+				if (room_id > UINT32_MAX) return true;
+			}
+		}
+		if (room_id != filter->room_id) return false;
+	}
+
+	return true;
+}
+
+static void logchunk_push_ordinal(LogChunk *chunk, size_t ordinal) {
+	if (chunk->entries.length > chunk->ordinals_capacity) {
+		chunk->ordinals_capacity = chunk->entries.capacity;
+		chunk->ordinals = realloc(
+			chunk->ordinals, chunk->ordinals_capacity * sizeof(size_t));
+		if (chunk->ordinals == NULL) die("failed to allocate ordinals", 1);
+	}
+	chunk->ordinals[chunk->entries.length - 1] = ordinal;
+}
+
+static void logchunk_parse_lines(LogChunk *chunk) {
+	char *cursor = chunk->begin;
+	for (; cursor < chunk->end; chunk->records_num++) {
+		if (chunk->filter != NULL) {
+			char *line_end =
+				(char *)scan_find(&record_line_end, cursor, chunk->end);
+			uint32_t timestamp;
+			if (chunk->in_order && line_end != chunk->end &&
+				logrecord_timestamp(cursor,
+					scan_find(&record_field_end, cursor, line_end),
+					&timestamp) &&
+				timestamp > chunk->filter->time_to) {
+				chunk->stopped = true;
+				return;
+			}
+			if (line_end != chunk->end &&
+				!logrecord_matches(cursor, line_end, chunk->filter)) {
+				cursor = line_end + 1;
+				continue;
+			}
+		}
+
+		LogEntry entry;
+		chunk->error = logrecord_parse(&cursor, chunk->end, &entry);
+		if (chunk->error != NULL) return;
+		logentry_push(&chunk->entries, entry);
+		if (chunk->filter != NULL)
+			logchunk_push_ordinal(chunk, chunk->records_num);
+	}
+}
+
+static bool logframe_record_matches(const LogFrameRecord *record,
+	const bool *names_match, const LogFilter *filter) {
+	if (record->timestamp < filter->time_from ||
+		record->timestamp > filter->time_to)
+		return false;
+	if (filter->name != NULL &&
+		(record->role != filter->role || !names_match[record->person]))
+		return false;
+	return filter->any_room || record->room_id == filter->room_id;
+}
+
+// Decodes the frames in [chunk->begin, chunk->end), keeping what matches the
+// filter like logchunk_parse_lines does. Names are only compared once per
+// frame, and only copied out for records that are kept.
+static void logchunk_parse_frames(LogChunk *chunk) {
+	const LogFilter *filter = chunk->filter;
+	LogFrameReader reader;
+	logframe_reader_init(&reader);
+	bool *names_match = NULL;
+	size_t name_len = filter != NULL && filter->name != NULL
+		? strlen(filter->name)
+		: 0;
+
+	const char *cursor = chunk->begin, *next;
+	for (; cursor < chunk->end; cursor = next) {
+		chunk->error = logframe_open(&reader, cursor, chunk->end, &next);
+		if (chunk->error != NULL) break;
+
+		if (filter != NULL && filter->name != NULL) {
+			names_match =
+				realloc(names_match, (reader.names_num + 1) * sizeof(bool));
+			if (names_match == NULL) die("failed to allocate name matches", 1);
+			for (size_t i = 0; i < reader.names_num; i++)
+				names_match[i] = reader.names[i].length >= name_len &&
+					memcmp(reader.names[i].name, filter->name, name_len) == 0;
+		}
+
+		for (size_t i = 0; i < reader.records_num; i++, chunk->records_num++) {
+			LogFrameRecord record;
+			chunk->error = logframe_next(&reader, &record);
+			if (chunk->error != NULL) break;
+			if (chunk->in_order && record.timestamp > filter->time_to) {
+				chunk->stopped = true;
+				break;
+			}
+			if (filter != NULL &&
+				!logframe_record_matches(&record, names_match, filter))
+				continue;
+
+			const LogFrameName *name = &reader.names[record.person];
+			LogEntry entry;
+			entry.timestamp = record.timestamp;
+			entry.room_id = record.room_id;
+			entry.event = record.event;
+			entry.person.role = record.role;
+			entry.person.name = malloc(name->length + 1);
+			if (entry.person.name == NULL) die("failed to allocate name", 1);
+			memcpy(entry.person.name, name->name, name->length);
+			entry.person.name[name->length] = '\0';
+			logentry_push(&chunk->entries, entry);
+			if (filter != NULL)
+				logchunk_push_ordinal(chunk, chunk->records_num);
+		}
+		if (chunk->error != NULL || chunk->stopped) break;
+	}
+
+	free(names_match);
+	logframe_reader_free(&reader);
+}
+
+static void logchunk_parse(LogChunk *chunk) {
+	if (chunk->encoding == LOG_ENCODING_COMPACT) logchunk_parse_frames(chunk);
+	else logchunk_parse_lines(chunk);
+}
+
+// Finds where the last whole record (or frame) in [begin, end) ends, for
+// parsing a body that's only partly read in
+static char *logchunk_whole_end(
+	char *begin, char *end, LogEncoding encoding) {
+	if (encoding == LOG_ENCODING_COMPACT) {
+		const char *next;
+		while (begin < end && logframe_skip(begin, end, &next) == NULL)
+			begin = (char *)next;
+		return begin;
+	}
+	for (char *iter = end; iter > begin; iter--) {
+		if (iter[-1] == '\n') return iter;
+	}
+	return begin;
+}
+
+static void logchunk_job(void *context, size_t job) {
+	logchunk_parse(&((LogChunk *)context)[job]);
+}
+
+static void logleaves_job(void *context, size_t job) {
+	LogLeafJobs *jobs = context;
+	size_t first = job * LOGFILE_LEAVES_PER_JOB;
+	size_t last = first + LOGFILE_LEAVES_PER_JOB;
+	if (last > jobs->leaves_num) last = jobs->leaves_num;
+	for (size_t i = first; i < last; i++)
+		merkle_hash_leaf(&jobs->body[i * MERKLE_BLOCK_SIZE], &jobs->leaves[i]);
+}
+
+static void *logjob_worker(void *data) {
+	LogJobQueue *queue = data;
+	for (;;) {
+		pthread_mutex_lock(&queue->lock);
+		size_t job = queue->next_job++;
+		pthread_mutex_unlock(&queue->lock);
+
+		if (job >= queue->jobs_num) return NULL;
+		queue->run(queue->context, job);
+	}
+}
+
+void logjobs_run(
+	LogJobFn run, void *context, size_t jobs_num, size_t threads_num) {
+	if (threads_num > jobs_num) threads_num = jobs_num;
+	if (threads_num <= 1) {
+		for (size_t i = 0; i < jobs_num; i++) run(context, i);
+		return;
+	}
+
+	LogJobQueue queue;
+	queue.run = run;
+	queue.context = context;
+	queue.jobs_num = jobs_num;
+	queue.next_job = 0;
+	pthread_mutex_init(&queue.lock, NULL);
+
+	pthread_t *threads = calloc(threads_num, sizeof(pthread_t));
+	if (threads == NULL) die("failed to allocate log threads", 1);
+	for (size_t i = 0; i < threads_num; i++) {
+		if (pthread_create(&threads[i], NULL, logjob_worker, &queue) != 0)
+			die("failed to start log worker thread", 1);
+	}
+	for (size_t i = 0; i < threads_num; i++) pthread_join(threads[i], NULL);
+
+	free(threads);
+	pthread_mutex_destroy(&queue.lock);
+}
+
+size_t logjobs_threads(void) {
+	long online = sysconf(_SC_NPROCESSORS_ONLN);
+	if (online < 1) return 1;
+	if (online > LOGFILE_MAX_THREADS) return LOGFILE_MAX_THREADS;
+	return (size_t)online;
+}
+
+// how many threads are worth using on a body of this size, out of at most
+// `threads_max`
+static size_t logfile_threads_for(size_t body_size, size_t threads_max) {
+	if (body_size < LOGFILE_PARALLEL_MIN_BODY || threads_max < 1) return 1;
+	return threads_max;
+}
+
+// Rebuilds the integrity tree of a body that's fully in memory. leaves are
+// independent, so they're hashed in parallel and only folded in order. the
+// tree's nodes go to `nodes_file`, if there is one.
+static void logfile_hash_body(const char *begin, const char *end,
+	size_t threads_max, FILE *nodes_file, MerkleTree *tree) {
+	size_t body_size = end - begin;
+
+	LogLeafJobs jobs;
+	jobs.body = begin;
+	jobs.leaves_num = body_size / MERKLE_BLOCK_SIZE;
+	jobs.leaves = malloc((jobs.leaves_num + 1) * sizeof(MerkleHash));
+	if (jobs.leaves == NULL) die("failed to allocate merkle leaves", 1);
+
+	size_t jobs_num = (jobs.leaves_num + LOGFILE_LEAVES_PER_JOB - 1) /
+		LOGFILE_LEAVES_PER_JOB;
+	logjobs_run(logleaves_job, &jobs, jobs_num,
+		logfile_threads_for(body_size, threads_max));
+
+	merkle_init(tree, nodes_file);
+	for (size_t i = 0; i < jobs.leaves_num; i++)
+		merkle_push_leaf(tree, &jobs.leaves[i]);
+	size_t hashed = jobs.leaves_num * MERKLE_BLOCK_SIZE;
+	merkle_feed(tree, &begin[hashed], body_size - hashed);
+	merkle_seal(tree);
+
+	free(jobs.leaves);
+}
+
+#ifdef LOGFILE_CHECK_CHUNKS
+// Parses [begin, end) again as a single chunk, and dies if that doesn't come
+// out the same as the chunked parse did. `out` and `error` are what that gave.
+static void logfile_check_chunks(char *begin, char *end, LogEncoding encoding,
+	const LogFilter *filter, const char *error, const LogFile *out) {
+	LogChunk whole;
+	memset(&whole, 0, sizeof(whole));
+	whole.begin = begin;
+	whole.end = end;
+	whole.encoding = encoding;
+	whole.filter = filter;
+	logchunk_parse(&whole);
+
+	bool same = (whole.error == NULL) == (error == NULL);
+	if (same && error == NULL) {
+		const LogEntryList *a = &whole.entries, *b = &out->entries;
+		same = whole.records_num == out->records_num && a->length == b->length;
+		for (size_t i = 0; same && i < a->length; i++) {
+			const LogEntry *x = &a->entry[i], *y = &b->entry[i];
+			same = x->timestamp == y->timestamp && x->room_id == y->room_id &&
+				x->event == y->event && x->person.role == y->person.role &&
+				strcmp(x->person.name, y->person.name) == 0 &&
+				(filter == NULL || whole.ordinals[i] == out->ordinals[i]);
+		}
+	}
+	if (!same) die("chunked parse differs from parsing the body whole", 1);
+
+	logentry_free(&whole.entries);
+	free(whole.ordinals);
+}
+#endif
+
+// Parses all records in [begin, end) that match `filter` (if there is one)
+// into `out`, in order.
+// Returns an error message from the first broken record, if any.
+static const char *logfile_parse_body(char *begin, char *end,
+	LogEncoding encoding, const LogFilter *filter, size_t threads_max,
+	LogFile *out) {
+	size_t body_size = end - begin;
+	size_t threads_num = logfile_threads_for(body_size, threads_max);
+	size_t chunks_num =
+		threads_num == 1 ? 1 : threads_num * LOGFILE_CHUNKS_PER_THREAD;
+
+	LogChunk *chunks = calloc(chunks_num, sizeof(LogChunk));
+	if (chunks == NULL) die("failed to allocate log chunks", 1);
+
+	// cut the body into roughly even pieces, then push every cut forward to
+	// just past the next newline so no record is split between two chunks.
+	// frames are hopped over from the start of the chunk instead, since a
+	// big one can cover more than one block.
+	char *chunk_begin = begin;
+	for (size_t i = 0; i < chunks_num; i++) {
+		char *chunk_end = end;
+		if (i + 1 < chunks_num && encoding == LOG_ENCODING_COMPACT) {
+			char *cut = begin + body_size / chunks_num * (i + 1);
+			const char *next;
+			chunk_end = chunk_begin;
+			while (chunk_end < cut) {
+				if (logframe_skip(chunk_end, end, &next) != NULL) {
+					chunk_end = end; // it's broken, let the parser say so
+					break;
+				}
+				chunk_end = (char *)next;
+			}
+		} else if (i + 1 < chunks_num) {
+			chunk_end = begin + body_size / chunks_num * (i + 1);
+			if (chunk_end < chunk_begin) chunk_end = chunk_begin;
+			char *newline = memchr(chunk_end, '\n', end - chunk_end);
+			chunk_end = newline == NULL ? end : newline + 1;
+		}
+		chunks[i].begin = chunk_begin;
+		chunks[i].end = chunk_end;
+		chunks[i].encoding = encoding;
+		chunks[i].filter = filter;
+		chunk_begin = chunk_end;
+	}
+
+	logjobs_run(logchunk_job, chunks, chunks_num, threads_num);
+
+	// stitch the chunk lists back together in file order
+	const char *error = NULL;
+	size_t total = 0;
+	for (size_t i = 0; i < chunks_num; i++) {
+		if (error == NULL) error = chunks[i].error;
+		total += chunks[i].entries.length;
+	}
+
+	LogEntryList *entries = &out->entries;
+	if (error == NULL && filter != NULL) {
+		out->ordinals = malloc((total + 1) * sizeof(size_t));
+		if (out->ordinals == NULL) die("failed to allocate ordinals", 1);
+	}
+	if (error == NULL && total > 0) {
+		entries->entry = malloc(total * sizeof(LogEntry));
+		if (entries->entry == NULL) die("failed to allocate log entries", 1);
+		entries->capacity = total;
+		for (size_t i = 0; i < chunks_num; i++) {
+			LogEntryList *part = &chunks[i].entries;
+			if (part->length > 0)
+				memcpy(&entries->entry[entries->length], part->entry,
+					part->length * sizeof(LogEntry));
+			// chunk ordinals count from the chunk's first record
+			for (size_t j = 0; filter != NULL && j < part->length; j++)
+				out->ordinals[entries->length + j] =
+					out->records_num + chunks[i].ordinals[j];
+			entries->length += part->length;
+			out->records_num += chunks[i].records_num;
+			free(part->entry);
+		}
+	} else {
+		for (size_t i = 0; i < chunks_num; i++) {
+			logentry_free(&chunks[i].entries);
+			out->records_num += chunks[i].records_num;
+		}
+	}
+
+	for (size_t i = 0; i < chunks_num; i++) free(chunks[i].ordinals);
+	free(chunks);
+#ifdef LOGFILE_CHECK_CHUNKS
+	if (chunks_num > 1)
+		logfile_check_chunks(begin, end, encoding, filter, error, out);
+#endif
+	return error;
+}
+
+void logreadoptions_init(LogReadOptions *options) {
+	options->threads_num = logjobs_threads();
+	options->messages = stdout;
+}
+
+static void logfile_report(FILE *messages, const char *filename,
+	const LogFile *parsed, const LogFilter *filter) {
+	fprintf(messages, "Log '%s' seems good!\n", filename);
+
+	if (filter == NULL)
+		fprintf(messages, "Read in log with %i entries\n",
+			(int)parsed->entries.length);
+	else
+		fprintf(messages, "Read in %i of the log's %i entries\n",
+			(int)parsed->entries.length, (int)parsed->records_num);
+}
+
+static FILE *logfile_open_sidecar(char *filename, const char *mode) {
+	char *sidecar_name = merkle_sidecar_name(filename);
+	FILE *sidecar = fopen(sidecar_name, mode);
+	free(sidecar_name);
+	return sidecar;
+}
+
+// Whether a log whose body ends right at its ENDLOG, with no trailer, is one
+// written before logs had integrity trailers. those were always text, and
+// never had a merkle sidecar next to them, which every log with a trailer
+// gets. they're read with the full record check they always had, and given a
+// trailer on their next append (see logfile_upgrade).
+static bool logfile_is_legacy(char *filename, LogEncoding encoding) {
+	if (encoding != LOG_ENCODING_TEXT) return false;
+	FILE *sidecar = logfile_open_sidecar(filename, "rb");
+	if (sidecar == NULL) return true;
+	fclose(sidecar);
+	return false;
+}
+
+// Reads and checks a whole log, keeping the records matching `filter`
+static LogFile *logfile_read_whole(char *filename, char *given_token,
+	const LogFilter *filter, const LogReadOptions *options) {
+	FILE *messages = options->messages;
 	FILE *file = fopen(filename, "r");
 	if (file == NULL) {
-		printf(CONSOLE_VIS_ERROR
+		fprintf(messages, CONSOLE_VIS_ERROR
 			"ERROR: Unable to open file '%s'" CONSOLE_VIS_RESET "\n",
 			filename);
 		return NULL;
 	}
 
-	char header[8];
-	int read = fread(header, 1, 8, file);
-	if (read != 8 || strncmp("STARTLOG", header, 8) != 0) {
-		printf(CONSOLE_VIS_ERROR
+	size_t f_len;
+	char *f_buf = read_whole_file(file, &f_len); // File buffer
+	fclose(file);
+	file = NULL;
+
+	if (f_buf == NULL || f_len < 8 || strncmp("STARTLOG", f_buf, 8) != 0) {
+		fprintf(messages, CONSOLE_VIS_ERROR
 			"ERROR: '%s' is not a valid log\n" CONSOLE_VIS_RESET,
 			filename);
+		free(f_buf);
 		return NULL;
 	}
 
-	char *f_buf = malloc(2048); // File buffer
-	char *e_buf = f_buf;        // Entry buffer
-	char *p_buf = f_buf;        // Previous buffer
+	char *f_end = f_buf + f_len;
+	char *token = f_buf + 8;
+	size_t token_len = strlen(given_token);
+	LogEncoding encoding;
+	if ((size_t)(f_end - token) <= token_len ||
+		strncmp(given_token, token, token_len) != 0 ||
+		!logfile_encoding_of(token[token_len], &encoding)) {
+		fprintf(messages, "Error: tokens do not match for '%s'.\n", filename);
+		free(f_buf);
+		return NULL;
+	}
+
+	// the body runs from the token terminator up to the last ENDLOG marker.
+	// the trailer never holds ENDLOG, so a marker found scanning backwards is
+	// the real one, whatever the body holds.
+	char *body = token + token_len + 1;
+	char *body_end = NULL;
+	for (char *iter = f_end - 6; iter >= body; iter--) {
+		if (strncmp(iter, "ENDLOG", 6) == 0) {
+			body_end = iter;
+			break;
+		}
+	}
+	if (body_end == NULL) {
+		fprintf(messages, CONSOLE_VIS_ERROR
+			"ERROR: '%s' is not a valid log! Missing ENDLOG\n"
+			CONSOLE_VIS_RESET,
+			filename);
+		free(f_buf);
+		return NULL;
+	}
 
-	int tokenSize = strlen(given_token);
-	fgets(f_buf, 2048, file);
-	e_buf = strtok(f_buf, "*");
-	int bufSize = strlen(e_buf);
-	if (strncmp(given_token, e_buf, tokenSize) != 0 ||
-		strncmp(e_buf, given_token, bufSize) != 0) {
-		printf("Error: tokens do not match.\n");
+	// everything after ENDLOG is the integrity trailer. a log from before
+	// trailers only gets the record check below, like it always did.
+	char *trailer = body_end + 6;
+	const char *integrity_msg = NULL;
+	if (trailer == f_end && logfile_is_legacy(filename, encoding)) {
+		fprintf(messages,
+			"Log '%s' has no integrity trailer yet, it gets one on its next "
+			"append\n",
+			filename);
+	} else {
+		if (trailer < f_end && *trailer == '\n') trailer++;
+		MerkleTree tree;
+		logfile_hash_body(body, body_end, options->threads_num, NULL, &tree);
+		integrity_msg =
+			merkle_trailer_check(&tree, trailer, f_end - trailer, given_token);
+	}
+	if (integrity_msg != NULL) {
+		fprintf(messages, CONSOLE_VIS_ERROR
+			"ERROR: Log '%s' failed integrity check: %s\n" CONSOLE_VIS_RESET,
+			filename, integrity_msg);
+		free(f_buf);
 		return NULL;
 	}
 
@@ -84,128 +749,872 @@ LogFile *logfile_read(char *filename, char *given_token) {
 	parsed->token_to_save = NULL;
 	parsed->entries.entry = NULL;
 	parsed->entries.length = 0;
+	parsed->entries.capacity = 0;
+	parsed->records_num = 0;
+	parsed->ordinals = NULL;
+	parsed->encoding = encoding;
 
-	e_buf = strtok(NULL, "#");
-	while (e_buf[0] != '\0' && strncmp(e_buf, "ENDLOG", 6) != 0 &&
-		strncmp(p_buf, "ENDLOG", 6) != 0) {
-		// Read timestamp
-		uint32_t timestamp = strtoul(e_buf, NULL, 16);
+	const char *msg = logfile_parse_body(
+		body, body_end, encoding, filter, options->threads_num, parsed);
+	free(f_buf);
+	if (msg != NULL) {
+		fprintf(messages, CONSOLE_VIS_ERROR
+			"ERROR: Log '%s' is broken: %s\n" CONSOLE_VIS_RESET,
+			filename, msg);
+		logfile_free(parsed);
+		return NULL;
+	}
 
-		// Read employee-name | guest-name | room-id
-		p_buf = e_buf;
-		e_buf = strtok(NULL, "#");
+	logfile_report(messages, filename, parsed, filter);
+	return parsed;
+}
 
-		LogPerson person;
-		person.role = e_buf[0];
+// bytes collected before they're handed to the kernel in one go
+#define LOGWRITER_CAPACITY (256 * 1024)
+// writes at least this big skip the buffer and go out alongside it
+#define LOGWRITER_DIRECT_MIN (LOGWRITER_CAPACITY / 2)
 
-		int name_len = (strlen(e_buf) - 1) + 1;
-		person.name = malloc(name_len * sizeof(char));
-		for (int i = 0; i < name_len; i++) { person.name[i] = e_buf[i + 1]; }
+// Buffers everything written to a log and writes it out with as few system
+// calls as possible. Body bytes are also fed to a merkle tree, in big runs
+// rather than a record at a time.
+typedef struct {
+	int fd;
+	char *buffer; // LOGWRITER_CAPACITY bytes, allocated once per writer
+	size_t length;
+	MerkleTree *tree; // bytes written while this is set are fed to it
+	size_t unhashed;  // start of the buffered bytes `tree` hasn't seen yet
+} LogWriter;
 
-		// Read arrival-time | departure-time
-		p_buf = e_buf;
-		e_buf = strtok(NULL, "#");
-		LogEventType event = e_buf[0];
+static void logwriter_init(LogWriter *writer, int fd) {
+	writer->fd = fd;
+	writer->buffer = malloc(LOGWRITER_CAPACITY);
+	if (writer->buffer == NULL) die("failed to allocate log writer", 1);
+	writer->length = 0;
+	writer->tree = NULL;
+	writer->unhashed = 0;
+}
 
-		if (e_buf[1] != '\0') {
-			printf(CONSOLE_VIS_ERROR
-				"ERROR: Log '%s' is broken\n" CONSOLE_VIS_RESET,
-				filename);
-			return NULL;
+// Writes every byte of `iov`, going around again for short writes
+static void logwriter_writev(int fd, struct iovec *iov, int iov_num) {
+	while (iov_num > 0) {
+		ssize_t written = writev(fd, iov, iov_num);
+		if (written < 0 && errno == EINTR) continue;
+		if (written < 0) die("couldn't write to logfile!", 1);
+
+		for (; iov_num > 0 && (size_t)written >= iov->iov_len; iov++) {
+			written -= iov->iov_len;
+			iov_num--;
+		}
+		if (iov_num > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
 		}
+	}
+}
+
+// feeds whatever's buffered and unhashed to the tree
+static void logwriter_hash(LogWriter *writer) {
+	if (writer->tree != NULL)
+		merkle_feed(writer->tree, &writer->buffer[writer->unhashed],
+			writer->length - writer->unhashed);
+	writer->unhashed = writer->length;
+}
+
+// Starts (or with NULL, stops) feeding written bytes to a tree
+static void logwriter_set_tree(LogWriter *writer, MerkleTree *tree) {
+	logwriter_hash(writer);
+	writer->tree = tree;
+}
+
+static void logwriter_flush(LogWriter *writer) {
+	logwriter_hash(writer);
+	struct iovec iov = {writer->buffer, writer->length};
+	logwriter_writev(writer->fd, &iov, 1);
+	writer->length = 0;
+	writer->unhashed = 0;
+}
+
+// Returns room for `length` more bytes at the end of the buffer, flushing it
+// first if needed. `length` can't be more than LOGWRITER_CAPACITY.
+static char *logwriter_reserve(LogWriter *writer, size_t length) {
+	if (LOGWRITER_CAPACITY - writer->length < length) logwriter_flush(writer);
+	return &writer->buffer[writer->length];
+}
+
+static void logwriter_put(LogWriter *writer, const char *data, size_t length) {
+	if (length < LOGWRITER_DIRECT_MIN) {
+		memcpy(logwriter_reserve(writer, length), data, length);
+		writer->length += length;
+		return;
+	}
+
+	// too big to be worth copying: out it goes, right after the buffer
+	logwriter_hash(writer);
+	if (writer->tree != NULL) merkle_feed(writer->tree, data, length);
+	struct iovec iov[2] = {
+		{writer->buffer, writer->length},
+		{(void *)data, length},
+	};
+	logwriter_writev(writer->fd, iov, 2);
+	writer->length = 0;
+	writer->unhashed = 0;
+}
 
-		// Optional: room-id
-		p_buf = e_buf;
-		e_buf = strtok(NULL, "#");
-		uint32_t room_id;
-		if (e_buf[0] != '\n') {
-			room_id = strtoul(e_buf, NULL, 10);
-		} else {
-			room_id = UINT32_MAX;
+// flushes, and lets go of the buffer. the file is left open.
+static void logwriter_finish(LogWriter *writer) {
+	logwriter_flush(writer);
+	free(writer->buffer);
+	writer->buffer = NULL;
+}
+
+// Writes `value` in lowercase hex without leading zeros. Returns the length.
+static size_t encode_hex(uint32_t value, char *out) {
+	static const char digits[] = "0123456789abcdef";
+	size_t length = 1;
+	for (uint32_t rest = value >> 4; rest != 0; rest >>= 4) length++;
+	for (size_t i = length; i-- > 0; value >>= 4) out[i] = digits[value & 0xf];
+	return length;
+}
+
+// Writes `value` in decimal. Returns the length.
+static size_t encode_decimal(uint32_t value, char *out) {
+	size_t length = 1;
+	for (uint32_t rest = value / 10; rest != 0; rest /= 10) length++;
+	for (size_t i = length; i-- > 0; value /= 10) out[i] = '0' + value % 10;
+	return length;
+}
+
+// longest a record gets on either side of its name: 8 hex digits, '#' and
+// the role before it, then '#', the event, '#', 10 decimal digits, '#' and
+// the newline after it
+#define LOGRECORD_MAX_FIXED 16
+
+static void logwriter_record(LogWriter *writer, const LogEntry *entry) {
+	char *out = logwriter_reserve(writer, LOGRECORD_MAX_FIXED);
+	size_t length = encode_hex(entry->timestamp, out);
+	out[length++] = '#';
+	out[length++] = entry->person.role;
+	writer->length += length;
+
+	const char *name = entry->person.name;
+	logwriter_put(writer, name, strlen(name));
+
+	out = logwriter_reserve(writer, LOGRECORD_MAX_FIXED);
+	length = 0;
+	out[length++] = '#';
+	out[length++] = entry->event;
+	out[length++] = '#';
+	if (entry->room_id != UINT32_MAX) {
+		length += encode_decimal(entry->room_id, &out[length]);
+		out[length++] = '#';
+	}
+	out[length++] = '\n';
+	writer->length += length;
+}
+
+// Writes records, feeding them to `tree` and, if there is one, `index` along
+// the way.
+static void logfile_write_records(LogWriter *writer, MerkleTree *tree,
+	TimeIndex *index, const LogEntry *entries, size_t entries_num) {
+	logwriter_set_tree(writer, tree);
+	for (size_t i = 0; i < entries_num; i++) {
+		// the tree has seen everything up to the unhashed bytes
+		uint64_t offset =
+			tree->body_length + (writer->length - writer->unhashed);
+		if (index != NULL) timeindex_add(index, offset, entries[i].timestamp);
+		logwriter_record(writer, &entries[i]);
+	}
+	logwriter_set_tree(writer, NULL);
+}
+
+// Writes out a finished frame, padded to the next block if another frame is
+// going to follow it
+static void logfile_put_frame(
+	LogWriter *writer, LogFrameWriter *frame, bool pad) {
+	static const char zeros[LOGFRAME_ALIGN];
+	size_t length;
+	const uint8_t *data = logframe_finish(frame, &length);
+	logwriter_put(writer, (const char *)data, length);
+	if (pad)
+		logwriter_put(writer, zeros,
+			(LOGFRAME_ALIGN - length % LOGFRAME_ALIGN) % LOGFRAME_ALIGN);
+}
+
+// Writes records as frames, carrying on from whatever `frame` already holds,
+// and finishes the last one. Frames are only ever read whole, so the index
+// gets each record as where its frame starts plus its place in the frame.
+static void logfile_write_frames(LogWriter *writer, MerkleTree *tree,
+	TimeIndex *index, LogFrameWriter *frame, const LogEntry *entries,
+	size_t entries_num) {
+	logwriter_set_tree(writer, tree);
+	for (size_t i = 0; i < entries_num; i++) {
+		if (!logframe_add(frame, &entries[i])) {
+			logfile_put_frame(writer, frame, true);
+			logframe_add(frame, &entries[i]);
 		}
+		// none of the frame is written yet, so it starts where the writer is
+		uint64_t offset =
+			tree->body_length + (writer->length - writer->unhashed);
+		if (index != NULL)
+			timeindex_add(index, offset + frame->records_num - 1,
+				entries[i].timestamp);
+		// a record too big for a block gets a frame to itself
+		if (logframe_size(frame) > LOGFRAME_ALIGN)
+			logfile_put_frame(writer, frame, true);
+	}
+	if (frame->records_num > 0) logfile_put_frame(writer, frame, false);
+	logwriter_set_tree(writer, NULL);
+}
 
-		LogEntry entry;
-		entry.timestamp = timestamp;
-		entry.person = person;
-		entry.event = event;
-		entry.room_id = room_id;
+static void logfile_write_trailer(
+	LogWriter *writer, MerkleTree *tree, char *token) {
+	char trailer[MERKLE_TRAILER_MAX];
+	merkle_seal(tree);
+	size_t length = merkle_trailer_format(tree, token, trailer);
+
+	logwriter_put(writer, "ENDLOG\n", 7);
+	logwriter_put(writer, trailer, length);
+}
+
+static void logfile_remove_index(char *filename) {
+	char *index_name = timeindex_sidecar_name(filename);
+	remove(index_name);
+	free(index_name);
+}
+
+// Ties a finished index to the log's new trailer. If that fails, the index is
+// removed rather than left half written.
+static void logfile_finish_index(char *filename, TimeIndex *index,
+	const MerkleTree *tree, const char *token) {
+	MerkleHash log_mac;
+	merkle_root_mac(tree, token, &log_mac);
+	if (!timeindex_finish(index, &log_mac)) logfile_remove_index(filename);
+}
+
+void logfile_write(char *filename, LogFile *data) {
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) die("couldn't create logfile!", 1);
+	FILE *sidecar = logfile_open_sidecar(filename, "wb");
+	if (sidecar == NULL) die("couldn't create merkle sidecar!", 1);
+
+	LogWriter writer;
+	logwriter_init(&writer, fd);
+	logwriter_put(&writer, "STARTLOG", 8);
+	logwriter_put(
+		&writer, data->token_to_save, strlen(data->token_to_save));
+	char marker = logfile_marker(data->encoding);
+	logwriter_put(&writer, &marker, 1);
 
-		logentry_push(&parsed->entries, entry);
+	// the index only speeds up reads, so a log can do without one
+	TimeIndex index;
+	bool indexed = timeindex_create(&index, filename, data->token_to_save);
 
-		// Load next entry or end of log
-		p_buf = e_buf;
-		fgets(f_buf, 1024, file);
-		e_buf = strtok(f_buf, "#");
+	MerkleTree tree;
+	merkle_init(&tree, sidecar);
+	if (data->encoding == LOG_ENCODING_COMPACT) {
+		LogFrameWriter frame;
+		logframe_writer_init(&frame);
+		logfile_write_frames(&writer, &tree, indexed ? &index : NULL, &frame,
+			data->entries.entry, data->entries.length);
+		logframe_writer_free(&frame);
+	} else {
+		logfile_write_records(&writer, &tree, indexed ? &index : NULL,
+			data->entries.entry, data->entries.length);
 	}
-	p_buf = e_buf;
+	logfile_write_trailer(&writer, &tree, data->token_to_save);
+	logwriter_finish(&writer);
 
-	if (strncmp(p_buf, "ENDLOG", 6) != 0) {
-		printf(CONSOLE_VIS_ERROR
-			"ERROR: '%s' is not a valid log! Read %s\n" CONSOLE_VIS_RESET,
-			filename, p_buf);
+	fclose(sidecar);
+	if (close(fd) != 0) die("couldn't write to logfile!", 1);
+
+	if (indexed)
+		logfile_finish_index(filename, &index, &tree, data->token_to_save);
+}
+
+// Hashes the whole body of a log without a trailer into `tree`, which then
+// stands in for the trailer it doesn't have.
+// Returns false if the body couldn't be read.
+static bool logfile_hash_legacy(FILE *file, long body_offset,
+	long endlog_offset, MerkleTree *tree) {
+	size_t body_size = (size_t)(endlog_offset - body_offset);
+	char *body = malloc(body_size + 1);
+	if (body == NULL) die("failed to allocate log body", 1);
+	bool read = fseek(file, body_offset, SEEK_SET) == 0 &&
+		fread(body, 1, body_size, file) == body_size;
+	if (read)
+		logfile_hash_body(
+			body, body + body_size, logjobs_threads(), NULL, tree);
+	free(body);
+	return read;
+}
+
+// Opens an existing log and loads its trailer, after checking the header
+// against the token. Only the start and the end of the log are read, unless
+// it's a log from before trailers: then its body is hashed in full, and
+// `*out_legacy` (if given) says so.
+// Prints an error to `messages` and returns NULL on failure.
+static FILE *logfile_open_trailer(char *filename, char *given_token,
+	const char *mode, FILE *messages, MerkleTree *tree,
+	long *out_endlog_offset, LogEncoding *out_encoding, bool *out_legacy) {
+	FILE *file = fopen(filename, mode);
+	if (file == NULL) {
+		fprintf(messages, CONSOLE_VIS_ERROR
+			"ERROR: Unable to open file '%s'" CONSOLE_VIS_RESET "\n",
+			filename);
 		return NULL;
 	}
 
-	printf("Log '%s' seems good!\n", filename);
+	// header: STARTLOG, then the token up to '*'
+	size_t token_len = strlen(given_token);
+	size_t body_offset = 8 + token_len + 1;
+	char *header = malloc(body_offset);
+	if (header == NULL) die("failed to allocate log header", 1);
+	bool header_ok = fread(header, 1, body_offset, file) == body_offset &&
+		strncmp("STARTLOG", header, 8) == 0;
+	bool token_ok = header_ok &&
+		logfile_encoding_of(header[body_offset - 1], out_encoding) &&
+		strncmp(given_token, &header[8], token_len) == 0;
+	free(header);
+	if (!header_ok || !token_ok) {
+		if (!header_ok)
+			fprintf(messages, CONSOLE_VIS_ERROR
+				"ERROR: '%s' is not a valid log\n" CONSOLE_VIS_RESET,
+				filename);
+		else
+			fprintf(messages, "Error: tokens do not match for '%s'.\n",
+				filename);
+		fclose(file);
+		return NULL;
+	}
 
-	free(f_buf);
+	// the trailer is bounded in size, so only the end of the log is read
+	char window[6 + 1 + MERKLE_TRAILER_MAX];
+	if (fseek(file, 0, SEEK_END) != 0) die("couldn't seek in logfile!", 1);
+	long file_size = ftell(file);
+	if (file_size < (long)body_offset) file_size = (long)body_offset;
+	size_t window_len = file_size - (long)body_offset;
+	if (window_len > sizeof(window)) window_len = sizeof(window);
+	long window_offset = file_size - (long)window_len;
+	if (fseek(file, window_offset, SEEK_SET) != 0 ||
+		fread(window, 1, window_len, file) != window_len)
+		die("couldn't read logfile trailer!", 1);
+
+	const char *msg = "missing ENDLOG";
+	long endlog_offset = -1;
+	bool legacy = false;
+	merkle_init(tree, NULL);
+	for (size_t i = window_len >= 6 ? window_len - 6 + 1 : 0; i-- > 0;) {
+		if (strncmp(&window[i], "ENDLOG", 6) == 0) {
+			endlog_offset = window_offset + (long)i;
+			size_t trailer = i + 6;
+			legacy = trailer == window_len &&
+				logfile_is_legacy(filename, *out_encoding);
+			if (legacy) {
+				msg = logfile_hash_legacy(
+						  file, (long)body_offset, endlog_offset, tree)
+					? NULL
+					: "couldn't read the log's body";
+				break;
+			}
+			if (trailer < window_len && window[trailer] == '\n') trailer++;
+			msg = merkle_trailer_parse(
+				tree, &window[trailer], window_len - trailer, given_token);
+			break;
+		}
+	}
+	if (msg == NULL &&
+		body_offset + tree->body_length != (uint64_t)endlog_offset)
+		msg = "integrity trailer doesn't match the body length";
+
+	if (msg != NULL) {
+		fprintf(messages, CONSOLE_VIS_ERROR
+			"ERROR: Log '%s' failed integrity check: %s\n" CONSOLE_VIS_RESET,
+			filename, msg);
+		fclose(file);
+		return NULL;
+	}
 
+	*out_endlog_offset = endlog_offset;
+	if (out_legacy != NULL) *out_legacy = legacy;
+	return file;
+}
+
+bool logfile_root_mac(char *filename, char *given_token, MerkleHash *out) {
+	MerkleTree tree;
+	long endlog_offset;
+	LogEncoding encoding;
+	FILE *file = logfile_open_trailer(filename, given_token, "r", stdout,
+		&tree, &endlog_offset, &encoding, NULL);
+	if (file == NULL) return false;
 	fclose(file);
-	file = NULL;
 
-	printf("Read in log with %i entries\n", (int)parsed->entries.length);
+	merkle_root_mac(&tree, given_token, out);
+	return true;
+}
 
-	return parsed;
+// blocks read (and checked) at a time when reading a window of a log
+#define LOGFILE_WINDOW_BLOCKS 64
+
+// Reads only the part of a log that `filter`'s time range can be in, using
+// the log's time index to find where that starts. Every block read is checked
+// against the trailer through the merkle sidecar, so nothing outside the
+// window is ever hashed.
+// Returns false if the log can't be read this way (no valid index or
+// sidecar), and the caller should read it whole. Otherwise the result goes in
+// `*out`, which is NULL if the log was found broken.
+static bool logfile_read_window(char *filename, char *given_token,
+	const LogFilter *filter, const LogReadOptions *options, LogFile **out) {
+	FILE *messages = options->messages;
+	MerkleTree tree;
+	long endlog_offset;
+	LogEncoding encoding;
+	*out = NULL;
+	FILE *file = logfile_open_trailer(filename, given_token, "r", messages,
+		&tree, &endlog_offset, &encoding, NULL);
+	if (file == NULL) return true;
+
+	MerkleHash log_mac;
+	merkle_root_mac(&tree, given_token, &log_mac);
+	TimeIndex index;
+	TimeIndexSample start;
+	const char *index_msg =
+		timeindex_open(&index, filename, given_token, &log_mac, false);
+	if (index_msg != NULL) {
+		fclose(file);
+		return false;
+	}
+	index_msg = timeindex_seek(&index, filter->time_from, &start);
+	bool sorted = index.sorted;
+	size_t records_num = index.records_num;
+	timeindex_close(&index);
+
+	// compact logs index records by their frame, see logfile_write_frames
+	size_t in_frame = 0;
+	if (encoding == LOG_ENCODING_COMPACT) {
+		in_frame = start.offset % LOGFRAME_ALIGN;
+		start.offset -= in_frame;
+	}
+
+	// a sidecar that's out of step would fail blocks that are fine
+	FILE *sidecar = logfile_open_sidecar(filename, "rb");
+	bool sidecar_ok = sidecar != NULL && fseek(sidecar, 0, SEEK_END) == 0 &&
+		(uint64_t)ftell(sidecar) == tree.nodes_num * MERKLE_HASH_SIZE;
+	if (index_msg != NULL || !sidecar_ok || in_frame > start.ordinal) {
+		if (sidecar != NULL) fclose(sidecar);
+		fclose(file);
+		return false;
+	}
+
+	LogChunk window;
+	memset(&window, 0, sizeof(window));
+	window.encoding = encoding;
+	window.filter = filter;
+	window.in_order = sorted;
+	window.records_num = start.ordinal - in_frame;
+
+	const char *integrity_msg = NULL;
+	uint64_t body_offset = (uint64_t)endlog_offset - tree.body_length;
+	uint64_t blocks_num =
+		(tree.body_length + MERKLE_BLOCK_SIZE - 1) / MERKLE_BLOCK_SIZE;
+	uint64_t block = start.offset / MERKLE_BLOCK_SIZE;
+	size_t skip = start.offset % MERKLE_BLOCK_SIZE;
+	if (fseek(file, (long)(body_offset + block * MERKLE_BLOCK_SIZE),
+			SEEK_SET) != 0)
+		die("couldn't seek in logfile!", 1);
+
+	// holds the blocks being parsed, after whatever's left of a record (or
+	// frame) that didn't fit in the last lot
+	size_t capacity = 0, length = 0;
+	char *buffer = NULL;
+	while (!window.stopped && window.error == NULL && integrity_msg == NULL &&
+		block < blocks_num) {
+		size_t batch = LOGFILE_WINDOW_BLOCKS * MERKLE_BLOCK_SIZE;
+		if (block * MERKLE_BLOCK_SIZE + batch > tree.body_length)
+			batch = tree.body_length - block * MERKLE_BLOCK_SIZE;
+		if (capacity < length + batch) {
+			capacity = length + batch;
+			buffer = realloc(buffer, capacity);
+			if (buffer == NULL) die("failed to allocate log window", 1);
+		}
+		char *data = &buffer[length];
+		if (fread(data, 1, batch, file) != batch)
+			die("couldn't read logfile!", 1);
+
+		for (size_t i = 0; i < batch; i += MERKLE_BLOCK_SIZE, block++) {
+			bool block_ok = batch - i >= MERKLE_BLOCK_SIZE
+				? merkle_verify_block(&tree, sidecar, block, &data[i])
+				: merkle_attach_tail(&tree, &data[i], batch - i);
+			if (!block_ok)
+				integrity_msg = "integrity check failed, log was modified";
+		}
+		if (integrity_msg != NULL) break;
+		length += batch;
+
+		// whatever's cut off at the end waits for the next lot, unless this
+		// is the last one. then it's broken, and parsing it says so.
+		char *end = &buffer[length];
+		window.begin = &buffer[skip];
+		window.end = block == blocks_num
+			? end
+			: logchunk_whole_end(window.begin, end, encoding);
+		skip = 0;
+		logchunk_parse(&window);
+		length = end - window.end;
+		memmove(buffer, window.end, length);
+	}
+	free(buffer);
+	fclose(sidecar);
+	fclose(file);
+
+	if (integrity_msg != NULL || window.error != NULL) {
+		if (integrity_msg != NULL)
+			fprintf(messages, CONSOLE_VIS_ERROR
+				"ERROR: Log '%s' failed integrity check: %s\n"
+				CONSOLE_VIS_RESET,
+				filename, integrity_msg);
+		else
+			fprintf(messages, CONSOLE_VIS_ERROR
+				"ERROR: Log '%s' is broken: %s\n" CONSOLE_VIS_RESET,
+				filename, window.error);
+		logentry_free(&window.entries);
+		free(window.ordinals);
+		return true;
+	}
+
+	LogFile *parsed = calloc(1, sizeof(LogFile));
+	if (parsed == NULL) die("failed to allocate log", 1);
+	parsed->entries = window.entries;
+	parsed->records_num = records_num;
+	parsed->encoding = encoding;
+	// filtered logs always have ordinals, even without any entries
+	parsed->ordinals = window.ordinals;
+	if (parsed->ordinals == NULL) parsed->ordinals = malloc(sizeof(size_t));
+	if (parsed->ordinals == NULL) die("failed to allocate ordinals", 1);
+
+	logfile_report(messages, filename, parsed, filter);
+	*out = parsed;
+	return true;
 }
 
-void logfile_write(char *filename, LogFile *data) {
-	FILE *file = fopen(filename, "w");
-	if (file == NULL) die("couldn't create logfile!", 1);
+LogFile *logfile_read(char *filename, char *given_token) {
+	return logfile_read_filtered(filename, given_token, NULL);
+}
+
+LogFile *logfile_read_filtered(
+	char *filename, char *given_token, const LogFilter *filter) {
+	LogReadOptions options;
+	logreadoptions_init(&options);
+	return logfile_read_with(filename, given_token, filter, &options);
+}
 
-	fprintf(file,
-		"STARTLOG"
-		"%s*",
-		data->token_to_save);
+LogFile *logfile_read_with(char *filename, char *given_token,
+	const LogFilter *filter, const LogReadOptions *options) {
+	// a time range only needs the part of the log it covers
+	if (filter != NULL &&
+		(filter->time_from > 0 || filter->time_to < UINT32_MAX)) {
+		LogFile *parsed;
+		if (logfile_read_window(
+				filename, given_token, filter, options, &parsed))
+			return parsed;
+	}
+	return logfile_read_whole(filename, given_token, filter, options);
+}
 
-	for (size_t i = 0; i < data->entries.length; i++) {
-		LogEntry *entry = &data->entries.entry[i];
+static void logfile_index_lines(char *body, char *end, TimeIndex *index) {
+	for (char *iter = body; iter < end;) {
+		char *line_end = (char *)scan_find(&record_line_end, iter, end);
+		const char *separator =
+			scan_find(&record_field_end, iter, line_end);
+		// a broken timestamp can't be asked for by time anyway
+		uint32_t timestamp = 0;
+		logrecord_timestamp(iter, separator, &timestamp);
+		timeindex_add(index, (uint64_t)(iter - body), timestamp);
+		iter = line_end + 1;
+	}
+}
 
-		fprintf(file,
-			"%x#"   // timestamp
-			"%c%s#" // person (role and name)
-			"%c#"   // event type
-			,
-			entry->timestamp, entry->person.role, entry->person.name,
-			entry->event);
-		if (entry->room_id != UINT32_MAX) {
-			fprintf(file, "%u#", entry->room_id);
+// Returns false if a frame is broken
+static bool logfile_index_frames(char *body, char *end, TimeIndex *index) {
+	LogFrameReader reader;
+	logframe_reader_init(&reader);
+	const char *iter = body, *next;
+	const char *msg = NULL;
+	for (; msg == NULL && iter < end; iter = next) {
+		msg = logframe_open(&reader, iter, end, &next);
+		for (size_t i = 0; msg == NULL && i < reader.records_num; i++) {
+			LogFrameRecord record;
+			msg = logframe_next(&reader, &record);
+			// see logfile_write_frames
+			if (msg == NULL)
+				timeindex_add(
+					index, (uint64_t)(iter - body) + i, record.timestamp);
 		}
-		fputc('\n', file);
+	}
+	logframe_reader_free(&reader);
+	return msg == NULL;
+}
+
+// Reads an opened log's whole body back in, for rebuilding the sidecars it
+// lost, and checks it against the trailer so they never cover anything the
+// trailer doesn't. The tree's nodes go to `nodes_file` on the way, if there
+// is one.
+// Returns the body (malloc'd), or NULL if it doesn't match the trailer.
+static char *logfile_reread_body(char *given_token, FILE *file,
+	long endlog_offset, const MerkleTree *tree, FILE *nodes_file) {
+	size_t body_size = tree->body_length;
+	char *body = malloc(body_size + 1);
+	if (body == NULL) die("failed to allocate log body", 1);
+	if (fseek(file, endlog_offset - (long)body_size, SEEK_SET) != 0 ||
+		fread(body, 1, body_size, file) != body_size) {
+		free(body);
+		return NULL;
+	}
+
+	MerkleTree rebuilt;
+	MerkleHash expected, actual;
+	logfile_hash_body(
+		body, body + body_size, logjobs_threads(), nodes_file, &rebuilt);
+	merkle_root_mac(tree, given_token, &expected);
+	merkle_root_mac(&rebuilt, given_token, &actual);
+	if (memcmp(expected.bytes, actual.bytes, MERKLE_HASH_SIZE) != 0) {
+		free(body);
+		return NULL;
+	}
+	return body;
+}
+
+// Indexes a log that has no usable index, e.g. one written before logs had
+// them, from its body (see logfile_reread_body).
+// Returns false (and removes any stale index) if it couldn't be done.
+static bool logfile_rebuild_index(char *filename, char *given_token,
+	char *body, size_t body_size, LogEncoding encoding, TimeIndex *index) {
+	if (!timeindex_create(index, filename, given_token)) {
+		logfile_remove_index(filename);
+		return false;
 	}
 
-	fprintf(file, "ENDLOG");
+	bool indexed = true;
+	if (encoding == LOG_ENCODING_COMPACT)
+		indexed = logfile_index_frames(body, body + body_size, index);
+	else
+		logfile_index_lines(body, body + body_size, index);
+	if (!indexed) {
+		timeindex_close(index);
+		logfile_remove_index(filename);
+	}
+	return indexed;
+}
+
+// Appends to a log from before trailers by reading it all in, with the full
+// check it always had, and writing it out again with the new entries, a
+// trailer and its sidecars. this only ever happens once per log.
+static bool logfile_upgrade(char *filename, char *given_token,
+	LogEntry *entries, size_t entries_num) {
+	LogReadOptions options;
+	logreadoptions_init(&options);
+	LogFile *log = logfile_read_whole(filename, given_token, NULL, &options);
+	if (log == NULL) return false;
+	printf("Adding an integrity trailer to log '%s'\n", filename);
+
+	for (size_t i = 0; i < entries_num; i++) {
+		LogEntry entry = entries[i];
+		size_t name_size = strlen(entry.person.name) + 1;
+		entry.person.name = malloc(name_size);
+		if (entry.person.name == NULL) die("failed to allocate name", 1);
+		memcpy(entry.person.name, entries[i].person.name, name_size);
+		logentry_push(&log->entries, entry);
+	}
+	log->token_to_save = given_token;
+	logfile_write(filename, log);
+	logfile_free(log);
+	return true;
+}
+
+bool logfile_append(char *filename, char *given_token, LogEntry *entries,
+	size_t entries_num) {
+	MerkleTree tree;
+	long endlog_offset;
+	LogEncoding encoding;
+	bool legacy;
+	FILE *file = logfile_open_trailer(filename, given_token, "r+", stdout,
+		&tree, &endlog_offset, &encoding, &legacy);
+	if (file == NULL) return false;
+	if (legacy) {
+		fclose(file);
+		return logfile_upgrade(filename, given_token, entries, entries_num);
+	}
+
+	// only the partial block at the end is about to change, so it's the
+	// only one that needs checking against the trailer
+	size_t tail_len = tree.body_length % MERKLE_BLOCK_SIZE;
+	char *tail = malloc(tail_len + 1);
+	if (tail == NULL) die("failed to allocate log tail", 1);
+	bool tail_ok = fseek(file, endlog_offset - (long)tail_len, SEEK_SET) == 0 &&
+		fread(tail, 1, tail_len, file) == tail_len &&
+		merkle_attach_tail(&tree, tail, tail_len);
+	if (!tail_ok) {
+		printf(CONSOLE_VIS_ERROR
+			"ERROR: Log '%s' failed integrity check: integrity check failed, "
+			"log was modified\n" CONSOLE_VIS_RESET,
+			filename);
+		free(tail);
+		fclose(file);
+		return false;
+	}
+
+	// in a compact log the tail is always the whole last frame. its records
+	// are decoded so the new ones can join them in it.
+	LogChunk last_frame;
+	memset(&last_frame, 0, sizeof(last_frame));
+	last_frame.begin = tail;
+	last_frame.end = tail + tail_len;
+	last_frame.encoding = LOG_ENCODING_COMPACT;
+	if (encoding == LOG_ENCODING_COMPACT) logchunk_parse(&last_frame);
+	free(tail);
+	if (last_frame.error != NULL) {
+		printf(CONSOLE_VIS_ERROR
+			"ERROR: Log '%s' is broken: %s\n" CONSOLE_VIS_RESET,
+			filename, last_frame.error);
+		logentry_free(&last_frame.entries);
+		fclose(file);
+		return false;
+	}
+
+	// new nodes go on the end of the sidecar. one that's gone or out of step
+	// is rebuilt from the body, so the log doesn't lose its quick block
+	// checks (and with them, quick time ranges) for good.
+	FILE *sidecar = logfile_open_sidecar(filename, "r+b");
+	bool rebuild_sidecar = sidecar == NULL ||
+		fseek(sidecar, 0, SEEK_END) != 0 ||
+		(uint64_t)ftell(sidecar) != tree.nodes_num * MERKLE_HASH_SIZE;
+	char *body = NULL;
+	bool body_ok = true;
+	if (rebuild_sidecar) {
+		if (sidecar != NULL) fclose(sidecar);
+		sidecar = logfile_open_sidecar(filename, "wb");
+		if (sidecar == NULL) die("couldn't create merkle sidecar!", 1);
+		body = logfile_reread_body(
+			given_token, file, endlog_offset, &tree, sidecar);
+		body_ok = body != NULL;
+	}
+	tree.nodes_file = sidecar;
+
+	// the index can only be extended if it matches the log as it is now.
+	// one that doesn't (or a log that never had one) is rebuilt first.
+	TimeIndex index;
+	bool indexed = false;
+	if (body_ok) {
+		MerkleHash log_mac;
+		merkle_root_mac(&tree, given_token, &log_mac);
+		indexed = timeindex_open(
+			&index, filename, given_token, &log_mac, true) == NULL;
+		if (!indexed && body == NULL) {
+			body = logfile_reread_body(
+				given_token, file, endlog_offset, &tree, NULL);
+			body_ok = body != NULL;
+		}
+		if (!indexed && body_ok)
+			indexed = logfile_rebuild_index(filename, given_token, body,
+				tree.body_length, encoding, &index);
+	}
+	free(body);
+
+	// only the tail was checked up front, but a body that had to be read
+	// back in has been checked in full
+	if (!body_ok) {
+		printf(CONSOLE_VIS_ERROR
+			"ERROR: Log '%s' failed integrity check: integrity check failed, "
+			"log was modified\n" CONSOLE_VIS_RESET,
+			filename);
+		fclose(sidecar);
+		if (rebuild_sidecar) {
+			char *sidecar_name = merkle_sidecar_name(filename);
+			remove(sidecar_name);
+			free(sidecar_name);
+		}
+		logentry_free(&last_frame.entries);
+		fclose(file);
+		return false;
+	}
+
+	// the last frame is written over, starting from its old records. it came
+	// out of the same encoder, so they fit just as they did before.
+	long write_offset = endlog_offset;
+	LogFrameWriter frame;
+	logframe_writer_init(&frame);
+	for (size_t i = 0; i < last_frame.entries.length; i++) {
+		if (!logframe_add(&frame, &last_frame.entries.entry[i]))
+			die("couldn't rebuild the last frame of the log!", 1);
+	}
+	if (encoding == LOG_ENCODING_COMPACT) {
+		merkle_drop_tail(&tree);
+		write_offset -= (long)tail_len;
+	}
+
+	// the stream was only ever read from, so its descriptor can be written
+	// to directly from here on
+	int fd = fileno(file);
+	if (lseek(fd, write_offset, SEEK_SET) < 0)
+		die("couldn't seek in logfile!", 1);
+	LogWriter writer;
+	logwriter_init(&writer, fd);
+	if (encoding == LOG_ENCODING_COMPACT)
+		logfile_write_frames(&writer, &tree, indexed ? &index : NULL, &frame,
+			entries, entries_num);
+	else
+		logfile_write_records(
+			&writer, &tree, indexed ? &index : NULL, entries, entries_num);
+	logfile_write_trailer(&writer, &tree, given_token);
+	logwriter_finish(&writer);
+	logframe_writer_free(&frame);
+	logentry_free(&last_frame.entries);
+
+	// a trailer can be shorter than the one it replaced
+	off_t end = lseek(fd, 0, SEEK_CUR);
+	if (end < 0 || ftruncate(fd, end) != 0)
+		die("couldn't truncate logfile!", 1);
+
+	fclose(sidecar);
 	fclose(file);
+
+	if (indexed) logfile_finish_index(filename, &index, &tree, given_token);
+	return true;
+}
+
+bool logfile_is_sidecar(const char *filename) {
+	static const char *suffixes[] = {
+		MERKLE_SIDECAR_SUFFIX,
+		TIMEINDEX_SIDECAR_SUFFIX,
+		ROLLUP_SIDECAR_SUFFIX,
+		ROLLUP_SIDECAR_SUFFIX ".tmp",
+	};
+	size_t length = strlen(filename);
+	for (size_t i = 0; i < sizeofarr(suffixes); i++) {
+		size_t suffix_length = strlen(suffixes[i]);
+		if (length >= suffix_length &&
+			strcmp(&filename[length - suffix_length], suffixes[i]) == 0)
+			return true;
+	}
+	return false;
 }
 
 void logentry_push(LogEntryList *list, LogEntry entry) {
-	size_t new_length = list->length + 1;
-	size_t new_size = new_length * sizeof(LogEntry);
-	if (new_size / sizeof(LogEntry) != new_length)
-		die("overflow in logentry push realloc", 1);
-	list->entry = realloc(list->entry, new_size);
-	if (list->entry == NULL)
-		die("failed to resize list in logentry push realloc", 1);
-	list->length = new_length;
-	list->entry[new_length - 1] = entry;
+	if (list->length == list->capacity) {
+		size_t new_capacity = list->capacity ? list->capacity * 2 : 16;
+		size_t new_size = new_capacity * sizeof(LogEntry);
+		if (new_size / sizeof(LogEntry) != new_capacity)
+			die("overflow in logentry push realloc", 1);
+		list->entry = realloc(list->entry, new_size);
+		if (list->entry == NULL)
+			die("failed to resize list in logentry push realloc", 1);
+		list->capacity = new_capacity;
+	}
+	list->entry[list->length++] = entry;
 }
 
 LogEntry logentry_pop(LogEntryList *list) {
-	LogEntry result = list->entry[list->length--];
-	size_t new_size = list->length * sizeof(LogEntry);
-	if (new_size / sizeof(LogEntry) != list->length)
-		die("overflow in logentry pop realloc", 1);
-	list->entry = realloc(list->entry, new_size);
-	return result;
+	// capacity is kept around, the next push will likely reuse it
+	return list->entry[--list->length];
 }
 // you're in charge of alloc'ing names
 // but we're in charge of freeing them
@@ -219,9 +1628,11 @@ void logentry_free(LogEntryList *list) {
 	free(list->entry);
 	list->entry = NULL;
 	list->length = 0;
+	list->capacity = 0;
 }
 
 void logfile_free(LogFile *file) {
 	logentry_free(&file->entries);
+	free(file->ordinals);
 	free(file);
 }
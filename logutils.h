@@ -2,9 +2,12 @@
 
 #include <stddef.h>  // -> size_t, ptrdiff_t
 #include <stdint.h>  // -> uint*_t
+#include <stdio.h>   // -> FILE
 #include <stdlib.h>  // -> malloc, free
 #include <stdbool.h> // -> bool
 
+#include "merkle.h"
+
 typedef enum {
 	LOG_ROLE_EMPLOYEE = '&',
 	LOG_ROLE_GUEST = '%',
@@ -29,25 +32,96 @@ typedef struct {
 
 typedef struct {
 	size_t length;
+	size_t capacity; // slots allocated in `entry`, grows geometrically
 	LogEntry *entry;
 } LogEntryList;
 
+// How a log's body is stored. Text has a line per record; compact packs
+// records into frames of columns (see logframe.h), which is smaller and
+// quicker to decode. The encoding is picked when a log is created, and kept.
+typedef enum {
+	LOG_ENCODING_TEXT,
+	LOG_ENCODING_COMPACT,
+} LogEncoding;
+
 typedef struct {
 	char *token_to_save;
+	LogEncoding encoding;
 	LogEntryList entries;
+	size_t records_num; // records in the log, including ones filtered out
+	// where each entry was among all the records, or NULL if nothing was
+	// filtered out
+	size_t *ordinals;
 } LogFile;
 
+// Which records a read keeps. Records are tested against it while still raw
+// bytes, so the ones that don't match are never decoded or allocated.
+typedef struct {
+	const char *name; // NULL for anyone, else names starting with this...
+	LogPersonRole role; // ...that also have this role
+	bool any_room;    // if false, only records in `room_id` are kept
+	uint32_t room_id; // UINT32_MAX for the gallery itself
+	uint32_t time_from, time_to; // inclusive
+} LogFilter;
+
+void logfilter_init(LogFilter *);
+// starts off matching every record
+
+// How a read goes about its work, as opposed to what it keeps
+typedef struct {
+	size_t threads_num; // most threads one log is hashed and parsed on
+	FILE *messages;     // where progress and errors are printed
+} LogReadOptions;
+
+void logreadoptions_init(LogReadOptions *);
+// starts off with every thread worth having, printing to stdout
+
 // STARTLOG and ENDLOG markers are not in LogEntries vec
 
 LogFile *logfile_read(char *filename, char *given_token);
 // ENDLOG is only checked for, not added to entries. if there's too many, don't
 // care if not found, error, return NULL, panic
+// big logs are split into chunks on record boundaries and parsed on a pool of
+// threads; the result is identical to parsing them front-to-back. building
+// with -DLOGFILE_CHECK_CHUNKS also parses them front-to-back, and dies if the
+// two ever differ.
+
+LogFile *logfile_read_filtered(
+	char *filename, char *given_token, const LogFilter *);
+// like logfile_read, but only keeps the records matching the filter. the
+// whole log is still integrity checked, unless the filter has a time range
+// and the log has a time index (see timeindex.h): then only the blocks that
+// range covers are read, and checked.
+
+LogFile *logfile_read_with(char *filename, char *given_token,
+	const LogFilter *, const LogReadOptions *);
+// like logfile_read_filtered (the filter can be NULL), but with a cap on the
+// threads it uses and its messages going somewhere else. meant for reading
+// several logs at once.
 
 void logfile_write(char *, LogFile *);
-// appends ENDLOG transparently
+// appends ENDLOG and the integrity trailer transparently, and rewrites the
+// merkle sidecar and time index next to the log
+
+bool logfile_append(char *filename, char *given_token, LogEntry *, size_t);
+// adds entries to the end of an existing log without reading it all back in,
+// in the log's own encoding. only the log's last block is checked (and, for a
+// compact log, rewritten), and only the right edge of its merkle tree is
+// rehashed. the time index is extended, or rebuilt if it doesn't match the
+// log, and so is a missing or out of step merkle sidecar. rebuilding means
+// checking the whole body first. prints an error and returns false on
+// failure.
+
+bool logfile_root_mac(char *filename, char *given_token, MerkleHash *out);
+// reads only a log's header and trailer, and gives the root mac they vouch for
+// (see merkle_root_mac), which identifies the log's current contents. prints
+// an error and returns false on failure.
 
 void logfile_free(LogFile *);
 
+bool logfile_is_sidecar(const char *filename);
+// whether a file is one of the helper files kept next to a log, and not a log
+
 const char *validate_token(char *);
 const char *validate_name(char *);
 
@@ -58,6 +132,15 @@ LogEntry logentry_pop(LogEntryList *);
 void logentry_free(LogEntryList *);
 // it's vaguely vec-like
 
+typedef void (*LogJobFn)(void *context, size_t job);
+
+void logjobs_run(LogJobFn, void *context, size_t jobs_num, size_t threads_num);
+// runs jobs [0, jobs_num) on up to `threads_num` threads, in no given order.
+// returns once all of them are done.
+
+size_t logjobs_threads(void);
+// how many threads are worth starting on this machine
+
 /*
 token is a password, we also have
 SL_PUBLIC and SL_PRIVATE env vars
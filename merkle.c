@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "merkle.h"
+#include "sidecar.h"
+
+// domain separation, so a leaf can never pass for an inner node or the root
+#define MERKLE_TAG_LEAF 0x00
+#define MERKLE_TAG_NODE 0x01
+#define MERKLE_TAG_ROOT 0x02
+
+static void merkle_hash_parts(MerkleHash *out, gcry_buffer_t *parts, int num) {
+	if (gcry_md_hash_buffers(GCRY_MD_SHA256, 0, out->bytes, parts, num) != 0)
+		die("failed to hash merkle node", 1);
+}
+
+static void merkle_hash_data(const char *data, size_t length, MerkleHash *out) {
+	uint8_t tag = MERKLE_TAG_LEAF;
+	gcry_buffer_t parts[] = {
+		{0, 0, 1, &tag},
+		{0, 0, length, (void *)data},
+	};
+	merkle_hash_parts(out, parts, sizeofarr(parts));
+}
+
+static void merkle_hash_node(
+	const MerkleHash *left, const MerkleHash *right, MerkleHash *out) {
+	uint8_t tag = MERKLE_TAG_NODE;
+	gcry_buffer_t parts[] = {
+		{0, 0, 1, &tag},
+		{0, 0, MERKLE_HASH_SIZE, (void *)left->bytes},
+		{0, 0, MERKLE_HASH_SIZE, (void *)right->bytes},
+	};
+	merkle_hash_parts(out, parts, sizeofarr(parts));
+}
+
+static void merkle_write_node(MerkleTree *tree, const MerkleHash *node) {
+	tree->nodes_num++;
+	if (tree->nodes_file == NULL) return;
+	if (fwrite(node->bytes, MERKLE_HASH_SIZE, 1, tree->nodes_file) != 1)
+		die("failed to write merkle sidecar", 1);
+}
+
+void merkle_init(MerkleTree *tree, FILE *nodes_file) {
+	memset(tree, 0, sizeof(MerkleTree));
+	tree->nodes_file = nodes_file;
+}
+
+void merkle_hash_leaf(const char *block, MerkleHash *out) {
+	merkle_hash_data(block, MERKLE_BLOCK_SIZE, out);
+}
+
+void merkle_push_leaf(MerkleTree *tree, const MerkleHash *leaf) {
+	if (tree->tail_length != 0) die("pushed a leaf past a partial block", 1);
+
+	MerkleHash node = *leaf;
+	uint8_t height = 0;
+	merkle_write_node(tree, &node);
+
+	// two peaks of the same height become one. since peaks are tallest
+	// first, that can only ever happen at the right edge.
+	while (tree->peaks_num > 0 &&
+		tree->peak_heights[tree->peaks_num - 1] == height) {
+		tree->peaks_num--;
+		merkle_hash_node(&tree->peaks[tree->peaks_num], &node, &node);
+		height++;
+		merkle_write_node(tree, &node);
+	}
+
+	tree->peaks[tree->peaks_num] = node;
+	tree->peak_heights[tree->peaks_num] = height;
+	tree->peaks_num++;
+	tree->body_length += MERKLE_BLOCK_SIZE;
+}
+
+void merkle_feed(MerkleTree *tree, const char *data, size_t length) {
+	while (length > 0) {
+		// whole blocks can be hashed straight from the caller's buffer
+		if (tree->tail_length == 0 && length >= MERKLE_BLOCK_SIZE) {
+			MerkleHash leaf;
+			merkle_hash_leaf(data, &leaf);
+			merkle_push_leaf(tree, &leaf);
+			data += MERKLE_BLOCK_SIZE;
+			length -= MERKLE_BLOCK_SIZE;
+			continue;
+		}
+
+		size_t room = MERKLE_BLOCK_SIZE - tree->tail_length;
+		size_t take = length < room ? length : room;
+		memcpy(&tree->tail[tree->tail_length], data, take);
+		tree->tail_length += take;
+		tree->body_length += take;
+		data += take;
+		length -= take;
+
+		if (tree->tail_length == MERKLE_BLOCK_SIZE) {
+			MerkleHash leaf;
+			merkle_hash_leaf(tree->tail, &leaf);
+			tree->tail_length = 0;
+			tree->body_length -= MERKLE_BLOCK_SIZE; // push adds it back
+			merkle_push_leaf(tree, &leaf);
+		}
+	}
+}
+
+void merkle_seal(MerkleTree *tree) {
+	merkle_hash_data(tree->tail, tree->tail_length, &tree->tail_hash);
+}
+
+void merkle_root_mac(
+	const MerkleTree *tree, const char *token, MerkleHash *out) {
+	uint8_t tag = MERKLE_TAG_ROOT;
+	uint8_t length[8];
+	for (int i = 0; i < 8; i++)
+		length[i] = (uint8_t)(tree->body_length >> (56 - 8 * i));
+
+	MerkleHash root;
+	gcry_buffer_t parts[] = {
+		{0, 0, 1, &tag},
+		{0, 0, sizeof(length), length},
+		{0, 0, tree->peaks_num * MERKLE_HASH_SIZE, (void *)tree->peaks},
+		{0, 0, MERKLE_HASH_SIZE, (void *)tree->tail_hash.bytes},
+	};
+	merkle_hash_parts(&root, parts, sizeofarr(parts));
+	token_mac(token, root.bytes, MERKLE_HASH_SIZE, NULL, 0, out->bytes);
+}
+
+static char *hash_to_hex(const MerkleHash *hash, char *out) {
+	return hex_encode(hash->bytes, MERKLE_HASH_SIZE, out);
+}
+
+static const char *hash_field(
+	const char *iter, const char *end, MerkleHash *out) {
+	return hex_bytes(iter, end, MERKLE_HASH_SIZE, out->bytes);
+}
+
+static bool hash_equal(const MerkleHash *a, const MerkleHash *b) {
+	return bytes_equal(a->bytes, b->bytes, MERKLE_HASH_SIZE);
+}
+
+size_t merkle_trailer_format(
+	const MerkleTree *tree, const char *token, char *out) {
+	char *iter = out;
+	iter += sprintf(iter, "MERKLE#%08x#%016llx#", MERKLE_BLOCK_SIZE,
+		(unsigned long long)tree->body_length);
+	for (size_t i = 0; i < tree->peaks_num; i++)
+		iter = hash_to_hex(&tree->peaks[i], iter);
+	*iter++ = '#';
+	iter = hash_to_hex(&tree->tail_hash, iter);
+	*iter++ = '#';
+
+	MerkleHash mac;
+	merkle_root_mac(tree, token, &mac);
+	iter = hash_to_hex(&mac, iter);
+	*iter++ = '#';
+
+	return iter - out;
+}
+
+// splits a trailer into its fields without checking the mac
+static const char *merkle_trailer_fields(
+	MerkleTree *tree, const char *trailer, size_t length, MerkleHash *mac) {
+	const char *iter = trailer, *end = trailer + length;
+	uint64_t block_size;
+
+	if (length < 7 || strncmp(iter, "MERKLE#", 7) != 0)
+		return "missing integrity trailer";
+	iter += 7;
+	if ((iter = hex_field(iter, end, 8, &block_size)) == NULL ||
+		block_size != MERKLE_BLOCK_SIZE)
+		return "integrity trailer has an unsupported block size";
+	if ((iter = hex_field(iter, end, 16, &tree->body_length)) == NULL)
+		return "integrity trailer has a malformed body length";
+
+	// every set bit of the leaf count is one peak, tallest first
+	uint64_t leaves_num = tree->body_length / MERKLE_BLOCK_SIZE;
+	tree->peaks_num = 0;
+	for (int height = 63; height >= 0; height--) {
+		if (!(leaves_num >> height & 1)) continue;
+		iter = hash_field(iter, end, &tree->peaks[tree->peaks_num]);
+		if (iter == NULL)
+			return "integrity trailer has malformed peaks";
+		tree->peak_heights[tree->peaks_num++] = (uint8_t)height;
+	}
+	tree->nodes_num = merkle_nodes_for(leaves_num);
+	tree->tail_length = 0;
+
+	if (iter >= end || *iter++ != '#' ||
+		(iter = hash_field(iter, end, &tree->tail_hash)) == NULL ||
+		iter >= end || *iter++ != '#' ||
+		(iter = hash_field(iter, end, mac)) == NULL || iter >= end ||
+		*iter++ != '#' || iter != end)
+		return "integrity trailer is malformed";
+
+	return NULL;
+}
+
+const char *merkle_trailer_parse(
+	MerkleTree *tree, const char *trailer, size_t length, const char *token) {
+	MerkleHash stored, expected;
+	const char *msg = merkle_trailer_fields(tree, trailer, length, &stored);
+	if (msg != NULL) return msg;
+
+	merkle_root_mac(tree, token, &expected);
+	if (!hash_equal(&stored, &expected))
+		return "integrity check failed, log was modified";
+	return NULL;
+}
+
+const char *merkle_trailer_check(const MerkleTree *tree, const char *trailer,
+	size_t length, const char *token) {
+	MerkleTree stored_tree;
+	MerkleHash stored, expected;
+	const char *msg =
+		merkle_trailer_fields(&stored_tree, trailer, length, &stored);
+	if (msg != NULL) return msg;
+
+	merkle_root_mac(tree, token, &expected);
+	if (!hash_equal(&stored, &expected))
+		return "integrity check failed, log was modified";
+	return NULL;
+}
+
+bool merkle_attach_tail(MerkleTree *tree, const char *tail, size_t length) {
+	if (length != tree->body_length % MERKLE_BLOCK_SIZE) return false;
+
+	MerkleHash hash;
+	merkle_hash_data(tail, length, &hash);
+	if (!hash_equal(&hash, &tree->tail_hash)) return false;
+
+	memcpy(tree->tail, tail, length);
+	tree->tail_length = length;
+	return true;
+}
+
+void merkle_drop_tail(MerkleTree *tree) {
+	tree->body_length -= tree->tail_length;
+	tree->tail_length = 0;
+}
+
+static bool merkle_read_node(
+	FILE *nodes_file, uint64_t position, MerkleHash *out) {
+	if (fseek(nodes_file, (long)(position * MERKLE_HASH_SIZE), SEEK_SET) != 0)
+		return false;
+	return fread(out->bytes, MERKLE_HASH_SIZE, 1, nodes_file) == 1;
+}
+
+bool merkle_verify_block(const MerkleTree *tree, FILE *nodes_file,
+	uint64_t block, const char *data) {
+	if (nodes_file == NULL) return false;
+
+	// find the peak holding the block. each peak of height h covers 2^h
+	// leaves and takes up 2^(h+1) - 1 nodes in postorder.
+	uint64_t offset = 0, first_leaf = 0;
+	size_t peak = 0;
+	for (; peak < tree->peaks_num; peak++) {
+		uint64_t leaves = (uint64_t)1 << tree->peak_heights[peak];
+		if (block < first_leaf + leaves) break;
+		offset += 2 * leaves - 1;
+		first_leaf += leaves;
+	}
+	if (peak == tree->peaks_num) return false; // past the complete blocks
+
+	// walk down from the peak and note the sibling at every level
+	uint64_t siblings[64];
+	bool sibling_is_left[64];
+	int depth = 0;
+	for (int height = tree->peak_heights[peak]; height > 0; height--) {
+		uint64_t half = (uint64_t)1 << (height - 1);
+		uint64_t left_root = offset + 2 * half - 2;
+		uint64_t right_root = offset + 4 * half - 3;
+		if (block < first_leaf + half) {
+			siblings[depth] = right_root;
+			sibling_is_left[depth] = false;
+		} else {
+			siblings[depth] = left_root;
+			sibling_is_left[depth] = true;
+			offset += 2 * half - 1;
+			first_leaf += half;
+		}
+		depth++;
+	}
+
+	// then hash back up and compare against the (mac'd) peak
+	MerkleHash node, sibling;
+	merkle_hash_leaf(data, &node);
+	while (depth-- > 0) {
+		if (!merkle_read_node(nodes_file, siblings[depth], &sibling))
+			return false;
+		if (sibling_is_left[depth]) merkle_hash_node(&sibling, &node, &node);
+		else merkle_hash_node(&node, &sibling, &node);
+	}
+
+	return hash_equal(&node, &tree->peaks[peak]);
+}
+
+uint64_t merkle_nodes_for(uint64_t leaves_num) {
+	uint64_t nodes = 0;
+	for (int height = 0; height < 64; height++) {
+		if (leaves_num >> height & 1) nodes += ((uint64_t)2 << height) - 1;
+	}
+	return nodes;
+}
+
+char *merkle_sidecar_name(const char *log_filename) {
+	return sidecar_name(log_filename, MERKLE_SIDECAR_SUFFIX);
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stddef.h>  // -> size_t
+#include <stdint.h>  // -> uint*_t
+#include <stdio.h>   // -> FILE
+#include <stdbool.h> // -> bool
+
+// Integrity for log bodies.
+//
+// the body is cut into fixed blocks. every complete block is a leaf of a
+// Merkle mountain range: a row of perfect trees ("peaks") that only ever grows
+// on its right edge, so appending a block adds at most log2(n) nodes and
+// touches nothing to its left. the trailing partial block is hashed on its
+// own. the body length, the peaks and the tail hash are bagged into one root,
+// and that root is MAC'd with the log token and kept in the log's trailer.
+//
+// every node is also streamed, in postorder, to a sidecar next to the log
+// (see MERKLE_SIDECAR_SUFFIX). that's what lets a reader check one block
+// against the trailer by reading its handful of siblings, rather than
+// rehashing the whole body.
+
+#define MERKLE_BLOCK_SIZE     4096
+#define MERKLE_HASH_SIZE      32 // sha-256
+#define MERKLE_MAX_PEAKS      64 // one per bit of the leaf count
+#define MERKLE_SIDECAR_SUFFIX ".merkle"
+
+// "MERKLE#" <block size, 8 hex> "#" <body length, 16 hex> "#" <peaks> "#"
+// <tail hash> "#" <root mac> "#", with every hash written as 64 hex digits
+#define MERKLE_TRAILER_MAX \
+	(7 + 9 + 17 + MERKLE_MAX_PEAKS * MERKLE_HASH_SIZE * 2 + 1 + \
+		2 * (MERKLE_HASH_SIZE * 2 + 1))
+
+typedef struct {
+	uint8_t bytes[MERKLE_HASH_SIZE];
+} MerkleHash;
+
+typedef struct {
+	uint64_t body_length; // bytes covered, complete blocks and tail together
+	uint64_t nodes_num;   // nodes in the range so far, also the sidecar's size
+
+	MerkleHash peaks[MERKLE_MAX_PEAKS]; // tallest first
+	uint8_t peak_heights[MERKLE_MAX_PEAKS];
+	size_t peaks_num;
+
+	// bytes past the last complete block. only ever filled in while feeding;
+	// a tree loaded from a trailer just knows `tail_hash` until a tail is
+	// attached.
+	char tail[MERKLE_BLOCK_SIZE];
+	size_t tail_length;
+	MerkleHash tail_hash; // only up to date after merkle_seal
+
+	FILE *nodes_file; // sidecar that new nodes are appended to, or NULL
+} MerkleTree;
+
+void merkle_init(MerkleTree *, FILE *nodes_file);
+
+void merkle_hash_leaf(const char *block, MerkleHash *out);
+// `block` is always MERKLE_BLOCK_SIZE bytes long
+
+void merkle_push_leaf(MerkleTree *, const MerkleHash *);
+// for callers that hash leaves themselves (e.g. on several threads).
+// only valid while the tree has no tail bytes.
+
+void merkle_feed(MerkleTree *, const char *data, size_t length);
+// appends body bytes, hashing each block as soon as it's complete
+
+void merkle_seal(MerkleTree *);
+// hashes the tail, call it before merkle_root_mac/merkle_trailer_format
+
+void merkle_root_mac(const MerkleTree *, const char *token, MerkleHash *out);
+
+size_t merkle_trailer_format(const MerkleTree *, const char *token, char *out);
+// writes at most MERKLE_TRAILER_MAX bytes, no null terminator. returns length.
+
+const char *merkle_trailer_parse(
+	MerkleTree *, const char *trailer, size_t length, const char *token);
+// loads body length, peaks and tail hash from a trailer and checks its mac.
+// returns an error message on failure.
+
+const char *merkle_trailer_check(
+	const MerkleTree *, const char *trailer, size_t length, const char *token);
+// checks a freshly built (and sealed) tree against a stored trailer
+
+bool merkle_attach_tail(MerkleTree *, const char *tail, size_t length);
+// gives a loaded tree its tail bytes back, so it can be fed again. returns
+// false if they don't match the trailer's tail hash.
+
+void merkle_drop_tail(MerkleTree *);
+// forgets the tail bytes, so the last partial block can be written over.
+// complete blocks stay as they are. only for trees with their tail attached.
+
+bool merkle_verify_block(
+	const MerkleTree *, FILE *nodes_file, uint64_t block, const char *data);
+// checks one complete block against a loaded tree, reading only its path
+// from the sidecar
+
+uint64_t merkle_nodes_for(uint64_t leaves_num);
+// how many nodes a range with `leaves_num` leaves has
+
+char *merkle_sidecar_name(const char *log_filename);
+// malloc'd, caller frees
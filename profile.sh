@@ -0,0 +1,222 @@
+#! /bin/sh
+
+# profiles logappend and logread on generated, realistic-looking logs.
+# run it through `make profile`, which builds with -O2 -g first.
+#
+# every case is timed on its own first, then run under callgrind
+# (instructions, cache misses, hot spots), massif (peak heap) and `perf stat`
+# (hardware counters). tools that aren't installed, or aren't allowed to run,
+# are skipped with a warning, so there's always at least the timings. raw
+# outputs are kept in $PROFILE_OUT, and a summary is printed at the end and
+# saved next to them.
+#
+# sizes can be changed through the environment:
+#   PROFILE_LOG_EVENTS    events in the log that's read (default 200000)
+#   PROFILE_BATCH_EVENTS  lines in the batch that's appended (default 20000)
+#   PROFILE_RUNS          timed runs per case, the best one counts (default 3)
+#   PROFILE_OUT           where results go (default ./profile_out)
+
+LOG_EVENTS=${PROFILE_LOG_EVENTS:-200000}
+BATCH_EVENTS=${PROFILE_BATCH_EVENTS:-20000}
+RUNS=${PROFILE_RUNS:-3}
+OUT=${PROFILE_OUT:-./profile_out}
+TOKEN=secret
+
+mkdir -p "$OUT"
+SUMMARY="$OUT/summary.txt"
+
+have() { command -v "$1" > /dev/null 2>&1; }
+
+# gen_batch <events> <log>
+# walks a crowd of people through the gallery while following its rules:
+# arrive, wander between rooms, leave. timestamps only ever go up.
+gen_batch() {
+	awk -v events="$1" -v logname="$2" -v token="$TOKEN" 'BEGIN {
+		srand(42)
+		people = 2000; rooms = 64
+		letters = "abcdefghijklmnopqrstuvwxyz"
+		for (i = 0; i < people; i++) {
+			name[i] = "Visitor"
+			for (n = i; n > 0 || name[i] == "Visitor"; n = int(n / 26))
+				name[i] = name[i] substr(letters, n % 26 + 1, 1)
+			flag[i] = i % 8 == 0 ? "-E" : "-G"
+			where[i] = -2 # -2 outside, -1 in the gallery, else a room
+		}
+		for (t = 1; t <= events; t++) {
+			p = int(rand() * people)
+			base = "-K " token " -T " t
+			if (where[p] == -2) {
+				print base " -A " flag[p] " " name[p] " " logname
+				where[p] = -1
+			} else if (where[p] == -1 && rand() < 0.85) {
+				where[p] = int(rand() * rooms)
+				print base " -A -R " where[p] " " flag[p] " " name[p] " " logname
+			} else if (where[p] == -1) {
+				print base " -L " flag[p] " " name[p] " " logname
+				where[p] = -2
+			} else {
+				print base " -L -R " where[p] " " flag[p] " " name[p] " " logname
+				where[p] = -1
+			}
+		}
+	}'
+}
+
+clean_log() { rm -f "$1" "$1.merkle" "$1.rollup" "$1.index"; }
+
+READ_LOG="$OUT/read.log"
+APPEND_LOG="$OUT/append.log"
+
+echo "generating a $LOG_EVENTS event log and a $BATCH_EVENTS line batch..."
+gen_batch "$LOG_EVENTS" "$READ_LOG" > "$OUT/read.batch"
+gen_batch "$BATCH_EVENTS" "$APPEND_LOG" > "$OUT/append.batch"
+clean_log "$READ_LOG"
+./logappend -B "$OUT/read.batch" > /dev/null || exit 1
+# the first line is always an arrival: -K <token> -T <t> -A (-E|-G) <name> <log>
+PERSON=$(awk 'NR == 1 { print $7 }' "$OUT/read.batch")
+PERSON_FLAG=$(awk 'NR == 1 { print $6 }' "$OUT/read.batch")
+
+# each case: <name> <command...>. the append case starts from a fresh log
+# every time, so every tool sees the same work. the tools pass on the exit
+# status of what they ran, so a case that fails stops everything here rather
+# than quietly profiling an error message.
+run_case() {
+	name=$1
+	shift
+	[ "$name" = append ] && clean_log "$APPEND_LOG"
+	if ! "$@" > "$OUT/$name.out" 2>&1; then
+		echo "ERROR: $name failed: $*" >&2
+		tail -n 5 "$OUT/$name.out" >&2
+		exit 1
+	fi
+}
+
+# perf can be installed but not allowed to count anything
+perf_usable() {
+	have perf && perf stat -e instructions true > /dev/null 2>&1
+}
+
+MISSING=""
+have valgrind || MISSING="$MISSING valgrind (callgrind, massif)"
+perf_usable || MISSING="$MISSING perf"
+[ -n "$MISSING" ] &&
+	echo "WARNING: not installed or not permitted:$MISSING. those are" \
+		"skipped, every case is still timed." >&2
+
+# wall clock in milliseconds, or in whole seconds where date can't do better
+now_ms() {
+	date +%s%N | awk '{
+		if ($1 ~ /^[0-9]+$/ && length($1) > 12)
+			print substr($1, 1, length($1) - 6)
+		else print int($1) * 1000
+	}'
+}
+
+# time_case <name> <command...>: best wall time of $RUNS plain runs
+time_case() {
+	name=$1
+	shift
+	best=""
+	run=0
+	while [ $run -lt "$RUNS" ]; do
+		start=$(now_ms)
+		run_case "$name" "$@"
+		taken=$(($(now_ms) - start))
+		[ -z "$best" ] || [ $taken -lt "$best" ] && best=$taken
+		run=$((run + 1))
+	done
+	echo "$best" > "$OUT/$name.time"
+}
+
+profile_case() {
+	name=$1
+	shift
+	echo "profiling $name: $*"
+
+	time_case "$name" "$@"
+
+	if have valgrind; then
+		run_case "$name" valgrind --tool=callgrind --cache-sim=yes \
+			--callgrind-out-file="$OUT/$name.callgrind" "$@"
+		run_case "$name" valgrind --tool=massif \
+			--massif-out-file="$OUT/$name.massif" "$@"
+	fi
+	if perf_usable; then
+		run_case "$name" perf stat -x, -o "$OUT/$name.perf" \
+			-e instructions,cycles,cache-references,cache-misses "$@"
+	fi
+}
+
+profile_case append ./logappend -B "$OUT/append.batch"
+profile_case read-S ./logread -K "$TOKEN" -S "$READ_LOG"
+profile_case read-R ./logread -K "$TOKEN" -R "$PERSON_FLAG" "$PERSON" "$READ_LOG"
+
+# callgrind_total <file> <event...>: sums the named events from the totals
+callgrind_total() {
+	file=$1
+	shift
+	awk -v wanted="$*" '
+		/^events:/ { for (i = 2; i <= NF; i++) index_of[$i] = i - 1 }
+		/^(summary|totals):/ {
+			n = split(wanted, names, " ")
+			for (i = 1; i <= n; i++) sum += $(index_of[names[i]] + 1)
+			print sum + 0
+			exit
+		}' "$file"
+}
+
+massif_peak() {
+	awk -F= '
+		/^mem_heap_B=/ { heap = $2 }
+		/^mem_heap_extra_B=/ { if (heap + $2 > peak) peak = heap + $2 }
+		END { print peak + 0 }' "$1"
+}
+
+perf_counter() {
+	awk -F, -v event="$2" '$3 ~ "^" event { print $1; exit }' "$1"
+}
+
+{
+	echo "PROFILE SUMMARY ($LOG_EVENTS event log, $BATCH_EVENTS line batch)"
+	[ -n "$MISSING" ] && echo "missing tools:$MISSING"
+	for name in append read-S read-R; do
+		echo
+		echo "== $name"
+
+		echo "wall time (ms):      $(cat "$OUT/$name.time") (best of $RUNS runs)"
+
+		if [ -s "$OUT/$name.callgrind" ]; then
+			echo "instructions:        $(callgrind_total "$OUT/$name.callgrind" Ir)"
+			echo "D1 misses:           $(callgrind_total "$OUT/$name.callgrind" D1mr D1mw)"
+			echo "LL data misses:      $(callgrind_total "$OUT/$name.callgrind" DLmr DLmw)"
+		else
+			echo "callgrind:           skipped (valgrind not available)"
+		fi
+
+		if [ -s "$OUT/$name.massif" ]; then
+			echo "peak heap (bytes):   $(massif_peak "$OUT/$name.massif")"
+		else
+			echo "massif:              skipped (valgrind not available)"
+		fi
+
+		if [ -s "$OUT/$name.perf" ] &&
+			[ -n "$(perf_counter "$OUT/$name.perf" instructions)" ]; then
+			echo "perf instructions:   $(perf_counter "$OUT/$name.perf" instructions)"
+			echo "perf cycles:         $(perf_counter "$OUT/$name.perf" cycles)"
+			echo "perf cache misses:   $(perf_counter "$OUT/$name.perf" cache-misses)"
+		else
+			echo "perf stat:           skipped (perf not available or not permitted)"
+		fi
+
+		if [ -s "$OUT/$name.callgrind" ] && have callgrind_annotate; then
+			echo "hot functions (self instructions):"
+			callgrind_annotate "$OUT/$name.callgrind" 2> /dev/null |
+				grep -E '^ *[0-9][0-9,]* ' | grep -v 'PROGRAM TOTALS' |
+				head -n 8 | sed 's/^/  /'
+		fi
+	done
+} > "$SUMMARY"
+
+cat "$SUMMARY"
+echo
+echo "raw outputs are in $OUT (open *.callgrind in kcachegrind, *.massif with ms_print)"
@@ -0,0 +1,842 @@
+#define _POSIX_C_SOURCE 200809L // -> rename over an existing file
+
+#include <stdarg.h> // -> va_list
+#include <limits.h> // -> LONG_MAX
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "rollup.h"
+#include "sidecar.h"
+
+static void rollup_index_init(RollupIndex *index) {
+	index->length = 0;
+	index->capacity = 0;
+	index->keys = NULL;
+	index->values = NULL;
+}
+
+static void rollup_index_free(RollupIndex *index) {
+	free(index->keys);
+	free(index->values);
+	rollup_index_init(index);
+}
+
+// Returns the slot a key lives in, or the empty slot it would go into
+static size_t rollup_index_slot(const RollupIndex *index, uint64_t key) {
+	size_t mask = index->capacity - 1;
+	size_t slot = (size_t)((key * 0x9e3779b97f4a7c15ull) >> 17) & mask;
+	while (index->values[slot] != SIZE_MAX && index->keys[slot] != key)
+		slot = (slot + 1) & mask;
+	return slot;
+}
+
+static void rollup_index_grow(RollupIndex *index) {
+	RollupIndex grown;
+	grown.length = index->length;
+	grown.capacity = index->capacity ? index->capacity * 2 : 64;
+	grown.keys = malloc(grown.capacity * sizeof(uint64_t));
+	grown.values = malloc(grown.capacity * sizeof(size_t));
+	if (grown.keys == NULL || grown.values == NULL)
+		die("failed to grow rollup index", 1);
+	for (size_t i = 0; i < grown.capacity; i++) grown.values[i] = SIZE_MAX;
+
+	for (size_t i = 0; i < index->capacity; i++) {
+		if (index->values[i] == SIZE_MAX) continue;
+		size_t slot = rollup_index_slot(&grown, index->keys[i]);
+		grown.keys[slot] = index->keys[i];
+		grown.values[slot] = index->values[i];
+	}
+
+	rollup_index_free(index);
+	*index = grown;
+}
+
+// Returns a key's value, or SIZE_MAX if it's not there
+static size_t rollup_index_find(const RollupIndex *index, uint64_t key) {
+	if (index->capacity == 0) return SIZE_MAX;
+	return index->values[rollup_index_slot(index, key)];
+}
+
+// Looks a key up, or inserts it with `value` if it's not there yet.
+// Returns whatever value the key ends up with.
+static size_t rollup_index_get(RollupIndex *index, uint64_t key, size_t value) {
+	// kept at most half full, so probes stay short
+	if ((index->length + 1) * 2 > index->capacity) rollup_index_grow(index);
+
+	size_t slot = rollup_index_slot(index, key);
+	if (index->values[slot] == SIZE_MAX) {
+		index->keys[slot] = key;
+		index->values[slot] = value;
+		index->length++;
+	}
+	return index->values[slot];
+}
+
+void rollup_init(Rollup *rollup) {
+	memset(rollup, 0, sizeof(Rollup));
+	rollup->bucket_width = ROLLUP_BUCKET_WIDTH;
+	gallery_init(&rollup->people);
+	rollup_index_init(&rollup->room_index);
+	rollup_index_init(&rollup->cell_index);
+}
+
+void rollup_free(Rollup *rollup) {
+	gallery_free(&rollup->people);
+	rollup_index_free(&rollup->room_index);
+	rollup_index_free(&rollup->cell_index);
+	free(rollup->rooms);
+	free(rollup->cells);
+	if (rollup->file != NULL) fclose(rollup->file);
+	rollup_init(rollup);
+}
+
+static RollupRoom *rollup_room(Rollup *rollup, uint32_t room_id) {
+	size_t index =
+		rollup_index_get(&rollup->room_index, room_id, rollup->rooms_num);
+	if (index < rollup->rooms_num) return &rollup->rooms[index];
+
+	if (rollup->rooms_num == rollup->rooms_capacity) {
+		size_t capacity = rollup->rooms_capacity;
+		rollup->rooms_capacity = capacity ? capacity * 2 : 16;
+		rollup->rooms = realloc(
+			rollup->rooms, rollup->rooms_capacity * sizeof(RollupRoom));
+		if (rollup->rooms == NULL) die("failed to grow rollup rooms", 1);
+	}
+
+	RollupRoom *room = &rollup->rooms[rollup->rooms_num++];
+	memset(room, 0, sizeof(RollupRoom));
+	room->room_id = room_id;
+	return room;
+}
+
+// Finds a room's bucket, starting it with the `count` people inside right now
+// if it's the first event in that bucket
+static RollupCell *rollup_cell(
+	Rollup *rollup, uint32_t room_id, uint32_t bucket, uint32_t count) {
+	uint64_t key = (uint64_t)room_id << 32 | bucket;
+	size_t index =
+		rollup_index_get(&rollup->cell_index, key, rollup->cells_num);
+	if (index < rollup->cells_num) return &rollup->cells[index];
+
+	if (rollup->cells_num == rollup->cells_capacity) {
+		size_t capacity = rollup->cells_capacity;
+		rollup->cells_capacity = capacity ? capacity * 2 : 64;
+		rollup->cells = realloc(
+			rollup->cells, rollup->cells_capacity * sizeof(RollupCell));
+		if (rollup->cells == NULL) die("failed to grow rollup cells", 1);
+	}
+
+	RollupCell *cell = &rollup->cells[rollup->cells_num++];
+	cell->room_id = room_id;
+	cell->bucket = bucket;
+	cell->peak = count;
+	cell->arrivals = 0;
+	cell->end = count;
+	return cell;
+}
+
+static void rollup_enter(Rollup *rollup, uint32_t room_id, uint32_t timestamp) {
+	RollupRoom *room = rollup_room(rollup, room_id);
+	RollupCell *cell = rollup_cell(rollup, room_id,
+		timestamp / rollup->bucket_width, room->count);
+
+	room->count++;
+	if (room->count > room->peak) {
+		room->peak = room->count;
+		room->peak_at = timestamp;
+	}
+
+	cell->arrivals++;
+	cell->end = room->count;
+	if (cell->end > cell->peak) cell->peak = cell->end;
+}
+
+static void rollup_leave(Rollup *rollup, uint32_t room_id, uint32_t timestamp) {
+	RollupRoom *room = rollup_room(rollup, room_id);
+	RollupCell *cell = rollup_cell(rollup, room_id,
+		timestamp / rollup->bucket_width, room->count);
+
+	if (room->count > 0) room->count--;
+	cell->end = room->count;
+}
+
+const char *rollup_apply(Rollup *rollup, const LogEntry *entry) {
+	uint32_t timestamp = entry->timestamp;
+	rollup->events++;
+	rollup->last_timestamp = timestamp;
+
+	const char *msg = gallery_apply(&rollup->people, entry);
+	if (msg != NULL) return msg;
+
+	// the rules only allow one move per event, so the entry alone says
+	// which room count changes. no room id (UINT32_MAX) is ROLLUP_GALLERY.
+	uint32_t room_id = entry->room_id;
+	if (entry->event == LOG_EVENT_ARRIVAL) {
+		rollup_enter(rollup, room_id, timestamp);
+	} else {
+		rollup_leave(rollup, room_id, timestamp);
+	}
+
+	if (entry->person.role == LOG_ROLE_GUEST && room_id == ROLLUP_GALLERY) {
+		if (entry->event == LOG_EVENT_ARRIVAL) {
+			rollup->guests_now++;
+			if (rollup->guests_now > rollup->guests_peak) {
+				rollup->guests_peak = rollup->guests_now;
+				rollup->guests_peak_at = timestamp;
+			}
+		} else if (rollup->guests_now > 0) {
+			rollup->guests_now--;
+		}
+	}
+
+	return NULL;
+}
+
+bool rollup_rebuild(Rollup *rollup, char *log_filename, char *token) {
+	rollup_init(rollup);
+	LogFile *file = logfile_read(log_filename, token);
+	if (file == NULL) return false;
+
+	for (size_t i = 0; i < file->entries.length; i++)
+		rollup_apply(rollup, &file->entries.entry[i]);
+
+	logfile_free(file);
+	return true;
+}
+
+uint64_t rollup_time_inside(const Rollup *rollup, const GalleryPerson *person) {
+	uint64_t total = person->total_time;
+	if (person->location != GALLERY_OUTSIDE &&
+		rollup->last_timestamp > person->entered_at)
+		total += rollup->last_timestamp - person->entered_at;
+	return total;
+}
+
+// "ROLLUP#" <bucket width, 8 hex> "#" <id, 32 hex> "#" <slots, 16 hex> "#"
+// <slots used, 16 hex> "#" <names length, 16 hex> "#" <events, 16 hex> "#"
+// <last timestamp, 8 hex> "#" <guests now, 8 hex> "#" <guests peak, 8 hex>
+// "#" <guests peak at, 8 hex> "#" <sum, 32 hex> "#" <mac, 64 hex> "#\n"
+#define ROLLUP_HEADER_MAC_AT \
+	(7 + 9 + ROLLUP_ID_SIZE * 2 + 1 + 17 * 4 + 9 * 4 + \
+		ROLLUP_SLOT_MAC_SIZE * 2 + 1)
+#define ROLLUP_HEADER_SIZE (ROLLUP_HEADER_MAC_AT + 64 + 2)
+
+// then the slots, each <kind, 1 byte> <key, 8> <values, 4 x 4> <wide values,
+// 2 x 8> <mac>, big endian and all zeroes while empty. a record goes in the
+// first free slot from where its key hashes to. after them come people's
+// names, each followed by a newline.
+#define ROLLUP_SLOT_MAC_AT (1 + 8 + 4 * 4 + 2 * 8)
+#define ROLLUP_SLOT_SIZE   (ROLLUP_SLOT_MAC_AT + ROLLUP_SLOT_MAC_SIZE)
+
+// a sidecar written out whole is left at most 3/8 full, and only written out
+// whole again once it'd be more than 3/4 full, so that happens less and less
+// often as it grows
+#define ROLLUP_SLOTS_MIN 64
+
+typedef enum {
+	ROLLUP_KIND_EMPTY = 0,
+	// values: role << 8 | location, room, entered at, name length.
+	// wide: total time, where the name is after the slots.
+	ROLLUP_KIND_PERSON = 'P',
+	// key: room. values: count, peak, peak at.
+	ROLLUP_KIND_ROOM = 'R',
+	// key: room << 32 | bucket. values: peak, arrivals, end.
+	ROLLUP_KIND_CELL = 'C',
+} RollupKind;
+
+typedef struct {
+	uint8_t kind;
+	uint64_t key;
+	uint32_t values[4];
+	uint64_t wide[2];
+	uint8_t mac[ROLLUP_SLOT_MAC_SIZE];
+	char *name; // only for people, terminated
+} RollupSlot;
+
+static long rollup_slot_at(uint64_t position) {
+	return ROLLUP_HEADER_SIZE + (long)position * ROLLUP_SLOT_SIZE;
+}
+
+// where probing for a record starts
+static uint64_t rollup_slot_start(
+	const Rollup *rollup, const RollupSlot *slot) {
+	uint64_t hash = (slot->key ^ slot->kind) * 0x9e3779b97f4a7c15ull;
+	return (hash >> 17) & (rollup->slots_num - 1);
+}
+
+static uint8_t *rollup_put(uint8_t *out, uint64_t value, size_t length) {
+	for (size_t i = 0; i < length; i++)
+		out[i] = (uint8_t)(value >> (8 * (length - 1 - i)));
+	return out + length;
+}
+
+static uint64_t rollup_get(const uint8_t **iter, size_t length) {
+	uint64_t value = 0;
+	for (size_t i = 0; i < length; i++) value = value << 8 | (*iter)[i];
+	*iter += length;
+	return value;
+}
+
+static void rollup_slot_encode(
+	const RollupSlot *slot, uint8_t out[ROLLUP_SLOT_SIZE]) {
+	uint8_t *iter = out;
+	*iter++ = slot->kind;
+	iter = rollup_put(iter, slot->key, 8);
+	for (size_t i = 0; i < 4; i++) iter = rollup_put(iter, slot->values[i], 4);
+	for (size_t i = 0; i < 2; i++) iter = rollup_put(iter, slot->wide[i], 8);
+	memcpy(iter, slot->mac, ROLLUP_SLOT_MAC_SIZE);
+}
+
+static void rollup_slot_decode(
+	const uint8_t bytes[ROLLUP_SLOT_SIZE], RollupSlot *out) {
+	const uint8_t *iter = bytes;
+	out->kind = *iter++;
+	out->key = rollup_get(&iter, 8);
+	for (size_t i = 0; i < 4; i++)
+		out->values[i] = (uint32_t)rollup_get(&iter, 4);
+	for (size_t i = 0; i < 2; i++) out->wide[i] = rollup_get(&iter, 8);
+	memcpy(out->mac, iter, ROLLUP_SLOT_MAC_SIZE);
+	out->name = NULL;
+}
+
+static void rollup_slot_init(RollupSlot *slot, uint8_t kind, uint64_t key) {
+	memset(slot, 0, sizeof(RollupSlot));
+	slot->kind = kind;
+	slot->key = key;
+}
+
+static void rollup_person_slot(GalleryPerson *person, RollupSlot *out) {
+	rollup_slot_init(
+		out, ROLLUP_KIND_PERSON, gallery_hash(person->role, person->name));
+	out->values[0] = (uint32_t)person->role << 8 | person->location;
+	out->values[1] = person->room_id;
+	out->values[2] = person->entered_at;
+	out->values[3] = (uint32_t)strlen(person->name);
+	out->wide[0] = person->total_time;
+	out->name = person->name;
+}
+
+static void rollup_room_slot(const RollupRoom *room, RollupSlot *out) {
+	rollup_slot_init(out, ROLLUP_KIND_ROOM, room->room_id);
+	out->values[0] = room->count;
+	out->values[1] = room->peak;
+	out->values[2] = room->peak_at;
+}
+
+static void rollup_cell_slot(const RollupCell *cell, RollupSlot *out) {
+	rollup_slot_init(
+		out, ROLLUP_KIND_CELL, (uint64_t)cell->room_id << 32 | cell->bucket);
+	out->values[0] = cell->peak;
+	out->values[1] = cell->arrivals;
+	out->values[2] = cell->end;
+}
+
+// Puts a record read from the sidecar in memory, unless it's there already
+static void rollup_take(Rollup *rollup, const RollupSlot *slot) {
+	if (slot->kind == ROLLUP_KIND_PERSON) {
+		LogPersonRole role = (LogPersonRole)(slot->values[0] >> 8);
+		if (gallery_find(&rollup->people, role, slot->name) != NULL) return;
+		GalleryPerson *person =
+			gallery_person(&rollup->people, role, slot->name);
+		person->location = (GalleryLocation)(slot->values[0] & 0xff);
+		person->room_id = slot->values[1];
+		person->entered_at = slot->values[2];
+		person->total_time = slot->wide[0];
+	} else if (slot->kind == ROLLUP_KIND_ROOM) {
+		if (rollup_index_find(&rollup->room_index, slot->key) != SIZE_MAX)
+			return;
+		RollupRoom *room = rollup_room(rollup, (uint32_t)slot->key);
+		room->count = slot->values[0];
+		room->peak = slot->values[1];
+		room->peak_at = slot->values[2];
+	} else {
+		if (rollup_index_find(&rollup->cell_index, slot->key) != SIZE_MAX)
+			return;
+		RollupCell *cell = rollup_cell(rollup, (uint32_t)(slot->key >> 32),
+			(uint32_t)slot->key, 0);
+		cell->peak = slot->values[0];
+		cell->arrivals = slot->values[1];
+		cell->end = slot->values[2];
+	}
+	rollup->fetched++;
+}
+
+// what a slot's mac covers: the sidecar it's in, where it is in there, the
+// slot itself and, for a person, their name
+static void rollup_slot_mac(const Rollup *rollup, uint64_t position,
+	const RollupSlot *slot, uint8_t out[ROLLUP_SLOT_MAC_SIZE]) {
+	uint8_t data[ROLLUP_ID_SIZE + 8 + ROLLUP_SLOT_SIZE];
+	memcpy(data, rollup->id, ROLLUP_ID_SIZE);
+	rollup_put(&data[ROLLUP_ID_SIZE], position, 8);
+	rollup_slot_encode(slot, &data[ROLLUP_ID_SIZE + 8]);
+
+	size_t name_length =
+		slot->kind == ROLLUP_KIND_PERSON ? slot->values[3] : 0;
+	uint8_t mac[SIDECAR_MAC_SIZE];
+	token_mac(rollup->token, data, ROLLUP_ID_SIZE + 8 + ROLLUP_SLOT_MAC_AT,
+		slot->name, name_length, mac);
+	memcpy(out, mac, ROLLUP_SLOT_MAC_SIZE);
+}
+
+static const char *rollup_slot_check(
+	const Rollup *rollup, uint64_t position, const RollupSlot *slot) {
+	if (slot->kind != ROLLUP_KIND_PERSON && slot->kind != ROLLUP_KIND_ROOM &&
+		slot->kind != ROLLUP_KIND_CELL)
+		return "rollup has a malformed slot";
+	uint8_t expected[ROLLUP_SLOT_MAC_SIZE];
+	rollup_slot_mac(rollup, position, slot, expected);
+	if (!bytes_equal(expected, slot->mac, ROLLUP_SLOT_MAC_SIZE))
+		return "rollup failed its integrity check";
+	return NULL;
+}
+
+static void rollup_sum_add(Rollup *rollup, const uint8_t *mac) {
+	for (size_t i = 0; i < ROLLUP_SLOT_MAC_SIZE; i++) rollup->sum[i] ^= mac[i];
+}
+
+// Formats the header, mac and all. `out` needs ROLLUP_HEADER_SIZE + 1 bytes.
+static void rollup_header_format(
+	const Rollup *rollup, const MerkleHash *log_mac, char *out) {
+	char id[ROLLUP_ID_SIZE * 2 + 1], sum[ROLLUP_SLOT_MAC_SIZE * 2 + 1];
+	*hex_encode(rollup->id, ROLLUP_ID_SIZE, id) = '\0';
+	*hex_encode(rollup->sum, ROLLUP_SLOT_MAC_SIZE, sum) = '\0';
+
+	sprintf(out,
+		"ROLLUP#%08x#%s#%016llx#%016llx#%016llx#%016llx#%08x#%08x#%08x#%08x#"
+		"%s#",
+		rollup->bucket_width, id, (unsigned long long)rollup->slots_num,
+		(unsigned long long)rollup->slots_used,
+		(unsigned long long)rollup->names_length,
+		(unsigned long long)rollup->events, rollup->last_timestamp,
+		rollup->guests_now, rollup->guests_peak, rollup->guests_peak_at, sum);
+
+	uint8_t mac[SIDECAR_MAC_SIZE];
+	token_mac(rollup->token, out, ROLLUP_HEADER_MAC_AT, log_mac->bytes,
+		MERKLE_HASH_SIZE, mac);
+	hex_encode(mac, sizeof(mac), &out[ROLLUP_HEADER_MAC_AT]);
+	strcpy(&out[ROLLUP_HEADER_SIZE - 2], "#\n");
+}
+
+static const char *rollup_read_header(
+	Rollup *rollup, FILE *file, const MerkleHash *log_mac) {
+	char header[ROLLUP_HEADER_SIZE + 1];
+	const char *end = &header[ROLLUP_HEADER_SIZE];
+	uint64_t width, slots, used, names, events, last, now, peak, peak_at;
+	const char *iter = header;
+	bool ok =
+		fread(header, 1, ROLLUP_HEADER_SIZE, file) == ROLLUP_HEADER_SIZE &&
+		strncmp(header, "ROLLUP#", 7) == 0 &&
+		(iter = hex_field(&header[7], end, 8, &width)) != NULL &&
+		(iter = hex_bytes(iter, end, ROLLUP_ID_SIZE, rollup->id)) != NULL &&
+		*iter++ == '#' && (iter = hex_field(iter, end, 16, &slots)) != NULL &&
+		(iter = hex_field(iter, end, 16, &used)) != NULL &&
+		(iter = hex_field(iter, end, 16, &names)) != NULL &&
+		(iter = hex_field(iter, end, 16, &events)) != NULL &&
+		(iter = hex_field(iter, end, 8, &last)) != NULL &&
+		(iter = hex_field(iter, end, 8, &now)) != NULL &&
+		(iter = hex_field(iter, end, 8, &peak)) != NULL &&
+		(iter = hex_field(iter, end, 8, &peak_at)) != NULL &&
+		(iter = hex_bytes(iter, end, ROLLUP_SLOT_MAC_SIZE, rollup->sum)) !=
+			NULL &&
+		*iter == '#';
+	// sizes have to fit in a file offset
+	uint64_t max = (LONG_MAX - ROLLUP_HEADER_SIZE) / ROLLUP_SLOT_SIZE / 2;
+	if (!ok || width == 0 || slots < ROLLUP_SLOTS_MIN || slots > max ||
+		(slots & (slots - 1)) != 0 || used > slots || names > max)
+		return "rollup has a malformed header";
+	rollup->bucket_width = (uint32_t)width;
+	rollup->slots_num = slots;
+	rollup->slots_used = used;
+	rollup->names_length = names;
+	rollup->events = events;
+	rollup->last_timestamp = (uint32_t)last;
+	rollup->guests_now = (uint32_t)now;
+	rollup->guests_peak = (uint32_t)peak;
+	rollup->guests_peak_at = (uint32_t)peak_at;
+
+	// rebuilt rather than checked field by field, like the time index's
+	char expected[ROLLUP_HEADER_SIZE + 1];
+	rollup_header_format(rollup, log_mac, expected);
+	if (!bytes_equal((uint8_t *)header, (uint8_t *)expected,
+			ROLLUP_HEADER_SIZE))
+		return "rollup doesn't match the log";
+	return NULL;
+}
+
+// Reads every slot, checks each of them and that they add up to the header's
+// sum, and puts the records memory doesn't have yet there
+static const char *rollup_read_slots(Rollup *rollup, FILE *file) {
+	size_t table_size = rollup->slots_num * ROLLUP_SLOT_SIZE;
+	size_t size = table_size + rollup->names_length;
+	uint8_t *data = malloc(size);
+	if (data == NULL) die("failed to allocate rollup", 1);
+	if (fseek(file, ROLLUP_HEADER_SIZE, SEEK_SET) != 0 ||
+		fread(data, 1, size, file) != size) {
+		free(data);
+		return "rollup is truncated";
+	}
+
+	char *names = (char *)&data[table_size];
+	uint8_t sum[ROLLUP_SLOT_MAC_SIZE] = {0};
+	const char *msg = NULL;
+	for (uint64_t i = 0; msg == NULL && i < rollup->slots_num; i++) {
+		RollupSlot slot;
+		rollup_slot_decode(&data[i * ROLLUP_SLOT_SIZE], &slot);
+		if (slot.kind == ROLLUP_KIND_EMPTY) continue;
+
+		if (slot.kind == ROLLUP_KIND_PERSON) {
+			uint64_t at = slot.wide[1], length = slot.values[3];
+			if (at >= rollup->names_length ||
+				length >= rollup->names_length - at ||
+				names[at + length] != '\n') {
+				msg = "rollup has a malformed person";
+				break;
+			}
+			names[at + length] = '\0';
+			slot.name = &names[at];
+		}
+
+		msg = rollup_slot_check(rollup, i, &slot);
+		if (msg != NULL) break;
+		for (size_t j = 0; j < ROLLUP_SLOT_MAC_SIZE; j++)
+			sum[j] ^= slot.mac[j];
+		rollup_take(rollup, &slot);
+	}
+	if (msg == NULL && !bytes_equal(sum, rollup->sum, ROLLUP_SLOT_MAC_SIZE))
+		msg = "rollup failed its integrity check";
+
+	free(data);
+	return msg;
+}
+
+const char *rollup_load(Rollup *rollup, const char *log_filename,
+	const char *token, const MerkleHash *log_mac) {
+	rollup_init(rollup);
+	rollup->token = token;
+
+	char *name = sidecar_name(log_filename, ROLLUP_SIDECAR_SUFFIX);
+	FILE *file = fopen(name, "rb");
+	free(name);
+	if (file == NULL) return "log has no rollup";
+
+	const char *msg = rollup_read_header(rollup, file, log_mac);
+	if (msg == NULL) msg = rollup_read_slots(rollup, file);
+	fclose(file);
+	if (msg != NULL) rollup_free(rollup);
+	return msg;
+}
+
+const char *rollup_open(Rollup *rollup, const char *log_filename,
+	const char *token, const MerkleHash *log_mac) {
+	rollup_init(rollup);
+	rollup->token = token;
+
+	char *name = sidecar_name(log_filename, ROLLUP_SIDECAR_SUFFIX);
+	FILE *file = fopen(name, "r+b");
+	free(name);
+	if (file == NULL) return "log has no rollup";
+
+	const char *msg = rollup_read_header(rollup, file, log_mac);
+	if (msg != NULL) {
+		fclose(file);
+		rollup_free(rollup);
+		return msg;
+	}
+	rollup->file = file;
+	return NULL;
+}
+
+// Reads and checks one slot of an open sidecar, along with its name if it's a
+// person. The name is malloc'd, and the caller frees it.
+static const char *rollup_slot_read(
+	Rollup *rollup, uint64_t position, RollupSlot *out) {
+	uint8_t bytes[ROLLUP_SLOT_SIZE];
+	if (fseek(rollup->file, rollup_slot_at(position), SEEK_SET) != 0 ||
+		fread(bytes, 1, sizeof(bytes), rollup->file) != sizeof(bytes))
+		return "rollup is truncated";
+	rollup_slot_decode(bytes, out);
+	if (out->kind == ROLLUP_KIND_EMPTY) {
+		memset(out->mac, 0, ROLLUP_SLOT_MAC_SIZE);
+		return NULL;
+	}
+
+	if (out->kind == ROLLUP_KIND_PERSON) {
+		uint64_t at = out->wide[1], length = out->values[3];
+		if (at >= rollup->names_length || length >= rollup->names_length - at)
+			return "rollup has a malformed person";
+		out->name = malloc(length + 1);
+		if (out->name == NULL) die("failed to allocate rollup name", 1);
+		if (fseek(rollup->file, rollup_slot_at(rollup->slots_num) + (long)at,
+				SEEK_SET) != 0 ||
+			fread(out->name, 1, length + 1, rollup->file) != length + 1 ||
+			out->name[length] != '\n') {
+			free(out->name);
+			out->name = NULL;
+			return "rollup has a malformed person";
+		}
+		out->name[length] = '\0';
+	}
+
+	const char *msg = rollup_slot_check(rollup, position, out);
+	if (msg != NULL) {
+		free(out->name);
+		out->name = NULL;
+	}
+	return msg;
+}
+
+// whether two slots hold the same record, if not the same figures
+static bool rollup_slot_is(const RollupSlot *a, const RollupSlot *b) {
+	if (a->kind != b->kind || a->key != b->key) return false;
+	if (a->kind != ROLLUP_KIND_PERSON) return true;
+	return a->values[0] >> 8 == b->values[0] >> 8 &&
+		strcmp(a->name, b->name) == 0;
+}
+
+// Looks a record up in an open sidecar, checking every slot on the way.
+// `*position` ends up at its slot, or the free one it would go in, and
+// `found` is what's there (ROLLUP_KIND_EMPTY if it's free).
+static const char *rollup_probe(Rollup *rollup, const RollupSlot *wanted,
+	uint64_t *position, RollupSlot *found) {
+	uint64_t mask = rollup->slots_num - 1;
+	// never full (see ROLLUP_SLOTS_MIN), so this always ends
+	for (uint64_t at = rollup_slot_start(rollup, wanted);;
+		at = (at + 1) & mask) {
+		const char *msg = rollup_slot_read(rollup, at, found);
+		if (msg != NULL) return msg;
+		if (found->kind == ROLLUP_KIND_EMPTY || rollup_slot_is(found, wanted)) {
+			*position = at;
+			return NULL;
+		}
+		free(found->name);
+	}
+}
+
+// Probes for a record, and puts it in memory if it was there
+static const char *rollup_fetch_slot(Rollup *rollup, const RollupSlot *wanted) {
+	uint64_t position;
+	RollupSlot found;
+	const char *msg = rollup_probe(rollup, wanted, &position, &found);
+	if (msg != NULL) return msg;
+	if (found.kind != ROLLUP_KIND_EMPTY) rollup_take(rollup, &found);
+	free(found.name);
+	return NULL;
+}
+
+const char *rollup_fetch(Rollup *rollup, const LogEntry *entry) {
+	if (rollup->file == NULL) return NULL;
+
+	RollupSlot wanted;
+	const char *msg;
+	LogPersonRole role = entry->person.role;
+	if (gallery_find(&rollup->people, role, entry->person.name) == NULL) {
+		rollup_slot_init(&wanted, ROLLUP_KIND_PERSON,
+			gallery_hash(role, entry->person.name));
+		wanted.values[0] = (uint32_t)role << 8;
+		wanted.name = entry->person.name;
+		if ((msg = rollup_fetch_slot(rollup, &wanted)) != NULL) return msg;
+	}
+
+	uint32_t room_id = entry->room_id;
+	if (rollup_index_find(&rollup->room_index, room_id) == SIZE_MAX) {
+		rollup_slot_init(&wanted, ROLLUP_KIND_ROOM, room_id);
+		if ((msg = rollup_fetch_slot(rollup, &wanted)) != NULL) return msg;
+	}
+
+	// a room that isn't anywhere has no buckets either
+	uint64_t cell_key =
+		(uint64_t)room_id << 32 | entry->timestamp / rollup->bucket_width;
+	if (rollup_index_find(&rollup->room_index, room_id) != SIZE_MAX &&
+		rollup_index_find(&rollup->cell_index, cell_key) == SIZE_MAX) {
+		rollup_slot_init(&wanted, ROLLUP_KIND_CELL, cell_key);
+		if ((msg = rollup_fetch_slot(rollup, &wanted)) != NULL) return msg;
+	}
+
+	return NULL;
+}
+
+// Writes a record over its slot in an open sidecar, or into a free one (with
+// its name after the others) if it's new
+static bool rollup_write_slot(Rollup *rollup, RollupSlot *slot) {
+	uint64_t position;
+	RollupSlot old;
+	if (rollup_probe(rollup, slot, &position, &old) != NULL) return false;
+	free(old.name);
+
+	if (old.kind == ROLLUP_KIND_EMPTY) {
+		if (slot->kind == ROLLUP_KIND_PERSON) {
+			slot->wide[1] = rollup->names_length;
+			long at = rollup_slot_at(rollup->slots_num) +
+				(long)rollup->names_length;
+			if (fseek(rollup->file, at, SEEK_SET) != 0 ||
+				fwrite(slot->name, 1, slot->values[3], rollup->file) !=
+					slot->values[3] ||
+				fputc('\n', rollup->file) == EOF)
+				return false;
+			rollup->names_length += slot->values[3] + 1;
+		}
+		rollup->slots_used++;
+	} else {
+		slot->wide[1] = old.wide[1];
+	}
+
+	rollup_slot_mac(rollup, position, slot, slot->mac);
+	rollup_sum_add(rollup, old.mac);
+	rollup_sum_add(rollup, slot->mac);
+	uint8_t bytes[ROLLUP_SLOT_SIZE];
+	rollup_slot_encode(slot, bytes);
+	return fseek(rollup->file, rollup_slot_at(position), SEEK_SET) == 0 &&
+		fwrite(bytes, 1, sizeof(bytes), rollup->file) == sizeof(bytes);
+}
+
+// Writes every record in memory back to the open sidecar, then the header,
+// which is what ties it to the log's new root mac
+static bool rollup_write_back(Rollup *rollup, const MerkleHash *log_mac) {
+	RollupSlot slot;
+	bool saved = true;
+	for (size_t i = 0; saved && i < rollup->people.capacity; i++) {
+		GalleryPerson *person = &rollup->people.slots[i];
+		if (person->name == NULL) continue;
+		rollup_person_slot(person, &slot);
+		saved = rollup_write_slot(rollup, &slot);
+	}
+	for (size_t i = 0; saved && i < rollup->rooms_num; i++) {
+		rollup_room_slot(&rollup->rooms[i], &slot);
+		saved = rollup_write_slot(rollup, &slot);
+	}
+	for (size_t i = 0; saved && i < rollup->cells_num; i++) {
+		rollup_cell_slot(&rollup->cells[i], &slot);
+		saved = rollup_write_slot(rollup, &slot);
+	}
+
+	char header[ROLLUP_HEADER_SIZE + 1];
+	rollup_header_format(rollup, log_mac, header);
+	saved = saved && fseek(rollup->file, 0, SEEK_SET) == 0 &&
+		fwrite(header, 1, ROLLUP_HEADER_SIZE, rollup->file) ==
+			ROLLUP_HEADER_SIZE;
+	saved &= fclose(rollup->file) == 0;
+	rollup->file = NULL;
+	return saved;
+}
+
+typedef struct {
+	char *data;
+	size_t length, capacity;
+} RollupText;
+
+static void rollup_text_printf(RollupText *text, const char *format, ...) {
+	va_list args;
+	for (;;) {
+		size_t room = text->capacity - text->length;
+		va_start(args, format);
+		int written = vsnprintf(&text->data[text->length], room, format, args);
+		va_end(args);
+		if (written < 0) die("failed to format rollup", 1);
+		if ((size_t)written < room) {
+			text->length += written;
+			return;
+		}
+
+		text->capacity = text->capacity * 2 + written;
+		text->data = realloc(text->data, text->capacity);
+		if (text->data == NULL) die("failed to grow rollup text", 1);
+	}
+}
+
+// Puts a record in the first free slot of a table being built in memory
+static void rollup_place(
+	Rollup *rollup, uint8_t *table, RollupText *names, RollupSlot *slot) {
+	if (slot->kind == ROLLUP_KIND_PERSON) {
+		slot->wide[1] = names->length;
+		rollup_text_printf(names, "%s\n", slot->name);
+	}
+
+	uint64_t mask = rollup->slots_num - 1;
+	uint64_t at = rollup_slot_start(rollup, slot);
+	while (table[at * ROLLUP_SLOT_SIZE] != ROLLUP_KIND_EMPTY)
+		at = (at + 1) & mask;
+	rollup_slot_mac(rollup, at, slot, slot->mac);
+	rollup_sum_add(rollup, slot->mac);
+	rollup_slot_encode(slot, &table[at * ROLLUP_SLOT_SIZE]);
+}
+
+// Writes out a whole new sidecar from what's in memory
+static bool rollup_write_whole(
+	Rollup *rollup, const char *log_filename, const MerkleHash *log_mac) {
+	uint64_t records =
+		rollup->people.length + rollup->rooms_num + rollup->cells_num;
+	rollup->slots_num = ROLLUP_SLOTS_MIN;
+	while (records * 8 > rollup->slots_num * 3) rollup->slots_num *= 2;
+	rollup->slots_used = records;
+	gcry_create_nonce(rollup->id, ROLLUP_ID_SIZE);
+	memset(rollup->sum, 0, ROLLUP_SLOT_MAC_SIZE);
+
+	size_t table_size = rollup->slots_num * ROLLUP_SLOT_SIZE;
+	uint8_t *table = calloc(table_size, 1);
+	RollupText names;
+	names.length = 0;
+	names.capacity = 4096;
+	names.data = malloc(names.capacity);
+	if (table == NULL || names.data == NULL)
+		die("failed to allocate rollup", 1);
+
+	RollupSlot slot;
+	for (size_t i = 0; i < rollup->people.capacity; i++) {
+		GalleryPerson *person = &rollup->people.slots[i];
+		if (person->name == NULL) continue;
+		rollup_person_slot(person, &slot);
+		rollup_place(rollup, table, &names, &slot);
+	}
+	for (size_t i = 0; i < rollup->rooms_num; i++) {
+		rollup_room_slot(&rollup->rooms[i], &slot);
+		rollup_place(rollup, table, &names, &slot);
+	}
+	for (size_t i = 0; i < rollup->cells_num; i++) {
+		rollup_cell_slot(&rollup->cells[i], &slot);
+		rollup_place(rollup, table, &names, &slot);
+	}
+	rollup->names_length = names.length;
+
+	char header[ROLLUP_HEADER_SIZE + 1];
+	rollup_header_format(rollup, log_mac, header);
+
+	// written next to the old one first, so a crash can't leave half a rollup
+	char *temp_name = sidecar_name(log_filename, ROLLUP_SIDECAR_SUFFIX ".tmp");
+	char *final_name = sidecar_name(log_filename, ROLLUP_SIDECAR_SUFFIX);
+	FILE *file = fopen(temp_name, "wb");
+	bool saved = file != NULL &&
+		fwrite(header, 1, ROLLUP_HEADER_SIZE, file) == ROLLUP_HEADER_SIZE &&
+		fwrite(table, 1, table_size, file) == table_size &&
+		fwrite(names.data, 1, names.length, file) == names.length;
+	if (file != NULL) saved &= fclose(file) == 0;
+	saved = saved && rename(temp_name, final_name) == 0;
+	if (!saved) remove(temp_name);
+
+	free(temp_name);
+	free(final_name);
+	free(table);
+	free(names.data);
+	return saved;
+}
+
+bool rollup_save(Rollup *rollup, const char *log_filename, const char *token,
+	const MerkleHash *log_mac) {
+	rollup->token = token;
+	if (rollup->file != NULL) {
+		uint64_t records =
+			rollup->people.length + rollup->rooms_num + rollup->cells_num;
+		uint64_t added = records - rollup->fetched;
+		if ((rollup->slots_used + added) * 4 <= rollup->slots_num * 3)
+			return rollup_write_back(rollup, log_mac);
+
+		// no room for them all, so everything else is read in too and the
+		// sidecar is written out again with more slots
+		const char *msg = rollup_read_slots(rollup, rollup->file);
+		fclose(rollup->file);
+		rollup->file = NULL;
+		if (msg != NULL) return false;
+	}
+	return rollup_write_whole(rollup, log_filename, log_mac);
+}
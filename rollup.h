@@ -0,0 +1,116 @@
+#pragma once
+
+#include <stdio.h>   // -> FILE
+#include <stdbool.h> // -> bool
+
+#include "gallery.h"
+#include "logutils.h"
+#include "merkle.h"
+
+// Running occupancy totals for a log, kept in a sidecar next to it (see
+// ROLLUP_SIDECAR_SUFFIX) so dashboards never have to go through the events.
+//
+// logappend folds every event in as it's appended, which costs a couple of
+// table lookups no matter how long the log is. the sidecar is a hash table of
+// fixed size slots, one per person, room and bucket, so an append only reads
+// and rewrites the few slots its events touch. every slot carries its own mac
+// and the header keeps their sum, so a read of the whole rollup still notices
+// any slot being swapped or dropped. the header is mac'd along with the root
+// mac of the log it was saved for, like the time index, so a rollup that fell
+// behind (or belongs to some other log) is noticed and rebuilt instead of
+// trusted.
+
+#define ROLLUP_SIDECAR_SUFFIX ".rollup"
+#define ROLLUP_BUCKET_WIDTH   3600 // timestamps per bucket, an hour of seconds
+#define ROLLUP_GALLERY        UINT32_MAX // room id of the gallery as a whole
+#define ROLLUP_ID_SIZE        16
+#define ROLLUP_SLOT_MAC_SIZE  16 // hmac-sha256, cut short
+
+typedef struct {
+	uint32_t room_id;
+	uint32_t count; // people inside right now
+	uint32_t peak;  // most people ever inside at once
+	uint32_t peak_at;
+} RollupRoom;
+
+typedef struct {
+	uint32_t room_id;
+	uint32_t bucket;   // timestamp / bucket width
+	uint32_t peak;     // most people inside at once during the bucket
+	uint32_t arrivals; // how many came in during the bucket
+	uint32_t end;      // people inside after the bucket's last event
+} RollupCell;
+
+// maps 64 bit keys to positions in one of the arrays below
+typedef struct {
+	size_t length;
+	size_t capacity; // always a power of two, or zero
+	uint64_t *keys;
+	size_t *values; // SIZE_MAX marks an empty slot
+} RollupIndex;
+
+typedef struct {
+	uint32_t bucket_width;
+	uint64_t events; // events folded in, including ones breaking the rules
+	uint32_t last_timestamp;
+
+	uint32_t guests_now, guests_peak, guests_peak_at;
+
+	GalleryState people; // also holds everyone's cumulative time
+
+	RollupIndex room_index;
+	RollupRoom *rooms;
+	size_t rooms_num, rooms_capacity;
+
+	RollupIndex cell_index;
+	RollupCell *cells;
+	size_t cells_num, cells_capacity;
+
+	// the sidecar. only open while it's being updated in place, when memory
+	// only holds the records fetched from it (see rollup_open)
+	FILE *file;
+	const char *token;
+	uint8_t id[ROLLUP_ID_SIZE]; // random, ties slots to their sidecar
+	uint64_t slots_num, slots_used;
+	uint64_t names_length; // of the names kept after the slots
+	uint8_t sum[ROLLUP_SLOT_MAC_SIZE]; // every used slot's mac xor'd together
+	uint64_t fetched;                  // records in memory that came from it
+} Rollup;
+
+void rollup_init(Rollup *);
+void rollup_free(Rollup *);
+
+const char *rollup_apply(Rollup *, const LogEntry *);
+// folds one event in. events that break the gallery's rules still count
+// towards `events`, but don't move anyone. returns the broken rule, if any.
+
+const char *rollup_load(Rollup *, const char *log_filename, const char *token,
+	const MerkleHash *log_mac);
+// reads and checks the whole sidecar. returns an error message if it's
+// missing, malformed, or wasn't saved with this token for the log with this
+// root mac (see merkle_root_mac). the rollup is left empty (but initialized)
+// then.
+
+const char *rollup_open(Rollup *, const char *log_filename, const char *token,
+	const MerkleHash *log_mac);
+// like rollup_load, but only reads the header, and leaves the sidecar open to
+// be updated in place. call rollup_fetch before folding each event in.
+
+const char *rollup_fetch(Rollup *, const LogEntry *);
+// reads in the records an event is about to change, unless they're in memory
+// already. returns an error message if one of them was tampered with. does
+// nothing for a rollup that wasn't opened with rollup_open.
+
+bool rollup_save(Rollup *, const char *log_filename, const char *token,
+	const MerkleHash *log_mac);
+// an opened rollup only writes back the records in memory, and the header.
+// otherwise, or if the sidecar is too full to take the new records, the
+// whole sidecar is written out again.
+
+bool rollup_rebuild(Rollup *, char *log_filename, char *token);
+// starts over from every event in the log. returns false (with the rollup
+// empty) if the log couldn't be read.
+
+uint64_t rollup_time_inside(const Rollup *, const GalleryPerson *);
+// cumulative time in the gallery, counting a visit that's still going on up
+// to the last event
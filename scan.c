@@ -0,0 +1,150 @@
+#define _POSIX_C_SOURCE 200809L // -> pthread_once
+
+#include <string.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "scan.h"
+
+#if !defined(SCAN_NO_SIMD) && defined(__GNUC__) && \
+	(defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+typedef const char *(*ScanFindFn)(
+	const ScanSet *, const char *begin, const char *end);
+
+static bool scan_in_set(const ScanSet *set, uint8_t c) {
+	return c == set->bytes[0] || c == set->bytes[1] || c == set->bytes[2] ||
+		c == set->bytes[3];
+}
+
+static const char *scan_find_scalar(
+	const ScanSet *set, const char *begin, const char *end) {
+	for (; begin < end; begin++) {
+		if (scan_in_set(set, (uint8_t)*begin)) return begin;
+	}
+	return end;
+}
+
+#ifdef SCAN_X86
+// compares 16 bytes against every byte of the set, and turns the matches into
+// a bitmask whose lowest set bit is the first hit
+__attribute__((target("sse2"))) static inline unsigned scan_mask16(
+	const char *at, __m128i b0, __m128i b1, __m128i b2, __m128i b3) {
+	__m128i chunk = _mm_loadu_si128((const __m128i *)at);
+	__m128i hits = _mm_or_si128(
+		_mm_or_si128(_mm_cmpeq_epi8(chunk, b0), _mm_cmpeq_epi8(chunk, b1)),
+		_mm_or_si128(_mm_cmpeq_epi8(chunk, b2), _mm_cmpeq_epi8(chunk, b3)));
+	return (unsigned)_mm_movemask_epi8(hits);
+}
+
+__attribute__((target("sse2"))) static const char *scan_find_sse2(
+	const ScanSet *set, const char *begin, const char *end) {
+	__m128i b0 = _mm_set1_epi8((char)set->bytes[0]);
+	__m128i b1 = _mm_set1_epi8((char)set->bytes[1]);
+	__m128i b2 = _mm_set1_epi8((char)set->bytes[2]);
+	__m128i b3 = _mm_set1_epi8((char)set->bytes[3]);
+
+	for (; end - begin >= 16; begin += 16) {
+		unsigned mask = scan_mask16(begin, b0, b1, b2, b3);
+		if (mask != 0) return begin + __builtin_ctz(mask);
+	}
+	return scan_find_scalar(set, begin, end);
+}
+
+// the same, 32 bytes at a time. the last few bytes are done in here too:
+// handing them to the sse2 kernel would mix in legacy sse instructions while
+// the upper halves of the registers are dirty, which stalls badly.
+__attribute__((target("avx2"))) static const char *scan_find_avx2(
+	const ScanSet *set, const char *begin, const char *end) {
+	__m128i b0 = _mm_set1_epi8((char)set->bytes[0]);
+	__m128i b1 = _mm_set1_epi8((char)set->bytes[1]);
+	__m128i b2 = _mm_set1_epi8((char)set->bytes[2]);
+	__m128i b3 = _mm_set1_epi8((char)set->bytes[3]);
+
+	if (end - begin >= 32) {
+		__m256i w0 = _mm256_broadcastb_epi8(b0);
+		__m256i w1 = _mm256_broadcastb_epi8(b1);
+		__m256i w2 = _mm256_broadcastb_epi8(b2);
+		__m256i w3 = _mm256_broadcastb_epi8(b3);
+		for (; end - begin >= 32; begin += 32) {
+			__m256i chunk = _mm256_loadu_si256((const __m256i *)begin);
+			__m256i hits = _mm256_or_si256(
+				_mm256_or_si256(
+					_mm256_cmpeq_epi8(chunk, w0), _mm256_cmpeq_epi8(chunk, w1)),
+				_mm256_or_si256(
+					_mm256_cmpeq_epi8(chunk, w2), _mm256_cmpeq_epi8(chunk, w3)));
+			unsigned mask = (unsigned)_mm256_movemask_epi8(hits);
+			if (mask != 0) return begin + __builtin_ctz(mask);
+		}
+	}
+
+	if (end - begin >= 16) {
+		unsigned mask = scan_mask16(begin, b0, b1, b2, b3);
+		if (mask != 0) return begin + __builtin_ctz(mask);
+		begin += 16;
+	}
+	return scan_find_scalar(set, begin, end);
+}
+#endif
+
+// the first one the cpu can run is used, unless another is asked for. avx2
+// comes last since it's never been measured quicker than sse2 (see scan.h).
+static const struct {
+	const char *name;
+	ScanFindFn find;
+} scan_kernels[] = {
+#ifdef SCAN_X86
+	{"sse2", scan_find_sse2},
+#endif
+	{"scalar", scan_find_scalar},
+#ifdef SCAN_X86
+	{"avx2", scan_find_avx2},
+#endif
+};
+
+static ScanFindFn scan_find_impl;
+static const char *scan_kernel_name;
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+static bool scan_supported(const char *name) {
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+	if (strcmp(name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+	if (strcmp(name, "sse2") == 0) return __builtin_cpu_supports("sse2");
+#endif
+	return strcmp(name, "scalar") == 0;
+}
+
+static void scan_pick(void) {
+	for (size_t i = 0; i < sizeofarr(scan_kernels); i++) {
+		if (!scan_supported(scan_kernels[i].name)) continue;
+		scan_find_impl = scan_kernels[i].find;
+		scan_kernel_name = scan_kernels[i].name;
+		return;
+	}
+}
+
+const char *scan_find(const ScanSet *set, const char *begin, const char *end) {
+	pthread_once(&scan_once, scan_pick);
+	return scan_find_impl(set, begin, end);
+}
+
+const char *scan_kernel(void) {
+	pthread_once(&scan_once, scan_pick);
+	return scan_kernel_name;
+}
+
+bool scan_use_kernel(const char *name) {
+	pthread_once(&scan_once, scan_pick);
+	for (size_t i = 0; i < sizeofarr(scan_kernels); i++) {
+		if (strcmp(scan_kernels[i].name, name) != 0 || !scan_supported(name))
+			continue;
+		scan_find_impl = scan_kernels[i].find;
+		scan_kernel_name = scan_kernels[i].name;
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>  // -> size_t
+#include <stdint.h>  // -> uint*_t
+#include <stdbool.h> // -> bool
+
+// Finds delimiters in text many bytes at a time. On x86 this uses SSE2, which
+// every x86-64 cpu has. Anywhere else, or if SCAN_NO_SIMD is defined, it's a
+// plain byte loop. There's an AVX2 kernel too, but it's only picked through
+// scan_use_kernel: fields here are a few bytes long, so 32 bytes at a time
+// mostly overshoots, and `make bench` has it no quicker than SSE2.
+
+#define SCAN_SET_MAX 4
+
+// Bytes to look for. Sets with fewer than SCAN_SET_MAX bytes repeat their last
+// byte, which lets every kernel always compare against all of them.
+typedef struct {
+	uint8_t bytes[SCAN_SET_MAX];
+} ScanSet;
+
+#define SCANSET1(a)          {{(a), (a), (a), (a)}}
+#define SCANSET2(a, b)       {{(a), (b), (b), (b)}}
+#define SCANSET3(a, b, c)    {{(a), (b), (c), (c)}}
+#define SCANSET4(a, b, c, d) {{(a), (b), (c), (d)}}
+
+const char *scan_find(const ScanSet *, const char *begin, const char *end);
+// returns the first byte in [begin, end) that's in the set, or `end`
+
+const char *scan_kernel(void);
+// name of the kernel in use: "avx2", "sse2" or "scalar"
+
+bool scan_use_kernel(const char *name);
+// switches to a kernel by name, for benchmarks and testing. returns false
+// (and changes nothing) if it isn't built in or the cpu can't run it.
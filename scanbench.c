@@ -0,0 +1,204 @@
+#define _POSIX_C_SOURCE 200809L // -> clock_gettime
+
+#include <stdlib.h> // -> EXIT_*
+#include <stdio.h>  // -> printf
+#include <time.h>
+#include <unistd.h> // -> dup
+
+#include "common.h"
+#include "logutils.h"
+#include "scan.h"
+
+// Compares the delimiter scanning kernels (see scan.h) on generated logs and
+// batch files. For every kernel the cpu can run, it times:
+//  - splitting a log body into records and fields, like the log parser does
+//  - splitting a batch file into fields, like `logappend -B` does
+//  - a whole logfile_read, integrity check included
+// usage: scanbench [records]
+
+#define BENCH_RUNS     5
+#define BENCH_LOG_FILE "scanbench.log"
+#define BENCH_TOKEN    "bench"
+
+static const char *bench_kernels[] = {"scalar", "sse2", "avx2"};
+
+static double bench_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// names from 3 to 12 letters, so fields aren't all the same width
+static void bench_name(size_t i, char *out) {
+	size_t length = 3 + i % 10;
+	for (size_t j = 0; j < length; j++, i /= 7)
+		out[j] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"[i % 52];
+	out[length] = '\0';
+}
+
+// Fills `log` with `records` made up events. Names come from `names`.
+static void bench_entries(LogFile *log, size_t records, char (*names)[16]) {
+	log->token_to_save = BENCH_TOKEN;
+	log->encoding = LOG_ENCODING_TEXT;
+	log->entries.length = records;
+	log->entries.capacity = records;
+	log->entries.entry = malloc((records + 1) * sizeof(LogEntry));
+	if (log->entries.entry == NULL) die("failed to allocate entries", 1);
+	log->records_num = records;
+	log->ordinals = NULL;
+
+	for (size_t i = 0; i < records; i++) {
+		LogEntry *entry = &log->entries.entry[i];
+		entry->timestamp = (uint32_t)i + 1;
+		entry->room_id = i % 3 == 0 ? UINT32_MAX : (uint32_t)(i * 31 % 1000);
+		entry->person.name = names[i % 4096];
+		entry->person.role = i % 5 == 0 ? LOG_ROLE_EMPLOYEE : LOG_ROLE_GUEST;
+		entry->event = i % 2 == 0 ? LOG_EVENT_ARRIVAL : LOG_EVENT_DEPARTURE;
+	}
+}
+
+// Makes batch file lines for the same events
+static char *bench_batch(const LogFile *log, size_t *out_length) {
+	size_t capacity = log->entries.length * 64 + 1;
+	char *batch = malloc(capacity);
+	if (batch == NULL) die("failed to allocate batch", 1);
+
+	size_t length = 0;
+	for (size_t i = 0; i < log->entries.length; i++) {
+		LogEntry *entry = &log->entries.entry[i];
+		length += sprintf(&batch[length], "-K %s -T %u %s -%c %s %s\n",
+			BENCH_TOKEN, entry->timestamp,
+			entry->event == LOG_EVENT_ARRIVAL ? "-A" : "-L",
+			entry->person.role == LOG_ROLE_EMPLOYEE ? 'E' : 'G',
+			entry->person.name, BENCH_LOG_FILE);
+	}
+	*out_length = length;
+	return batch;
+}
+
+// Reads a whole file into memory
+static char *bench_slurp(const char *filename, size_t *out_length) {
+	FILE *file = fopen(filename, "rb");
+	if (file == NULL) die("couldn't open benchmark log", 1);
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	char *result = malloc((size_t)size + 1);
+	if (result == NULL) die("failed to allocate benchmark log", 1);
+	*out_length = fread(result, 1, (size_t)size, file);
+	fclose(file);
+	return result;
+}
+
+// splits records on newlines, then each record on '#'. returns the field
+// count so the work can't be optimized away.
+static size_t bench_split_log(const char *begin, const char *end) {
+	static const ScanSet line_end = SCANSET1('\n');
+	static const ScanSet field_end = SCANSET1('#');
+	size_t fields = 0;
+	while (begin < end) {
+		const char *line = scan_find(&line_end, begin, end);
+		for (const char *field = begin; field < line; fields++)
+			field = scan_find(&field_end, field, line) + 1;
+		begin = line + 1;
+	}
+	return fields;
+}
+
+// splits a batch file into fields the way logappend does
+static size_t bench_split_batch(const char *begin, const char *end) {
+	static const ScanSet separators = SCANSET4(' ', '\t', '\n', '\r');
+	size_t fields = 0;
+	while (begin < end) {
+		if (*begin == ' ' || *begin == '\t' || *begin == '\n' ||
+			*begin == '\r') {
+			begin++;
+			continue;
+		}
+		fields++;
+		begin = scan_find(&separators, begin, end);
+	}
+	return fields;
+}
+
+// best time of a few runs
+#define bench_time(out_seconds, out_result, expr) \
+	do { \
+		*(out_seconds) = 1e30; \
+		for (int run = 0; run < BENCH_RUNS; run++) { \
+			double start = bench_now(); \
+			*(out_result) = (expr); \
+			double taken = bench_now() - start; \
+			if (taken < *(out_seconds)) *(out_seconds) = taken; \
+		} \
+	} while (0)
+
+static size_t bench_read(void) {
+	LogFile *log = logfile_read(BENCH_LOG_FILE, BENCH_TOKEN);
+	if (log == NULL) die("couldn't read benchmark log", 1);
+	size_t length = log->entries.length;
+	logfile_free(log);
+	return length;
+}
+
+int main(int argv, char *argc[]) {
+	size_t records = argv > 1 ? strtoul(argc[1], NULL, 10) : 1000000;
+	if (records == 0) {
+		printf("usage: scanbench [records]\n");
+		return EXIT_FAILURE;
+	}
+	if (!init_libgcrypt()) return EXIT_FAILURE;
+
+	static char names[4096][16];
+	for (size_t i = 0; i < 4096; i++) bench_name(i, names[i]);
+
+	LogFile log;
+	bench_entries(&log, records, names);
+	logfile_write(BENCH_LOG_FILE, &log);
+
+	size_t batch_length, log_length;
+	char *batch = bench_batch(&log, &batch_length);
+	char *body = bench_slurp(BENCH_LOG_FILE, &log_length);
+	free(log.entries.entry);
+
+	// logfile_read is chatty, keep it out of the results
+	FILE *quiet = freopen("/dev/null", "w", stdout) ? stdout : NULL;
+	FILE *results = fdopen(dup(2), "w");
+	if (quiet == NULL || results == NULL) die("couldn't redirect output", 1);
+
+	fprintf(results,
+		"%lu records: %.1f MiB log, %.1f MiB batch file, best of %d runs\n"
+		"%-8s %14s %14s %14s\n",
+		(unsigned long)records, log_length / 1048576.0,
+		batch_length / 1048576.0, BENCH_RUNS, "kernel", "log MiB/s",
+		"batch MiB/s", "read MiB/s");
+
+	for (size_t i = 0; i < sizeofarr(bench_kernels); i++) {
+		if (!scan_use_kernel(bench_kernels[i])) {
+			fprintf(results, "%-8s %14s\n", bench_kernels[i], "unsupported");
+			continue;
+		}
+
+		double log_time, batch_time, read_time;
+		size_t log_fields, batch_fields, read_entries;
+		bench_time(&log_time, &log_fields,
+			bench_split_log(body, body + log_length));
+		bench_time(&batch_time, &batch_fields,
+			bench_split_batch(batch, batch + batch_length));
+		bench_time(&read_time, &read_entries, bench_read());
+
+		fprintf(results, "%-8s %14.1f %14.1f %14.1f   (%lu %lu %lu)\n",
+			bench_kernels[i], log_length / 1048576.0 / log_time,
+			batch_length / 1048576.0 / batch_time,
+			log_length / 1048576.0 / read_time, (unsigned long)log_fields,
+			(unsigned long)batch_fields, (unsigned long)read_entries);
+	}
+
+	fclose(results);
+	free(batch);
+	free(body);
+	remove(BENCH_LOG_FILE);
+	remove(BENCH_LOG_FILE ".merkle");
+	remove(BENCH_LOG_FILE ".index");
+	return EXIT_SUCCESS;
+}
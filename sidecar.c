@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "sidecar.h"
+
+char *sidecar_name(const char *log_filename, const char *suffix) {
+	size_t length = strlen(log_filename);
+	size_t suffix_length = strlen(suffix);
+	char *result = malloc(length + suffix_length + 1);
+	if (result == NULL) die("failed to allocate sidecar name", 1);
+	memcpy(result, log_filename, length);
+	memcpy(&result[length], suffix, suffix_length + 1);
+	return result;
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+char *hex_encode(const uint8_t *bytes, size_t length, char *out) {
+	for (size_t i = 0; i < length; i++) {
+		*out++ = hex_digits[bytes[i] >> 4];
+		*out++ = hex_digits[bytes[i] & 0xf];
+	}
+	return out;
+}
+
+static int hex_value(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+const char *hex_field(
+	const char *iter, const char *end, size_t digits, uint64_t *out) {
+	if ((size_t)(end - iter) < digits + 1 || iter[digits] != '#') return NULL;
+	*out = 0;
+	for (size_t i = 0; i < digits; i++) {
+		int value = hex_value(iter[i]);
+		if (value < 0) return NULL;
+		*out = (*out << 4) | (uint64_t)value;
+	}
+	return iter + digits + 1;
+}
+
+const char *hex_bytes(
+	const char *iter, const char *end, size_t length, uint8_t *out) {
+	if ((size_t)(end - iter) < length * 2) return NULL;
+	for (size_t i = 0; i < length; i++) {
+		int high = hex_value(iter[2 * i]), low = hex_value(iter[2 * i + 1]);
+		if (high < 0 || low < 0) return NULL;
+		out[i] = (uint8_t)(high << 4 | low);
+	}
+	return iter + length * 2;
+}
+
+bool bytes_equal(const uint8_t *a, const uint8_t *b, size_t length) {
+	uint8_t diff = 0;
+	for (size_t i = 0; i < length; i++) diff |= a[i] ^ b[i];
+	return diff == 0;
+}
+
+void token_mac(const char *token, const void *data, size_t length,
+	const void *extra, size_t extra_length, uint8_t out[SIDECAR_MAC_SIZE]) {
+	// with GCRY_MD_FLAG_HMAC the first buffer is the key
+	gcry_buffer_t parts[] = {
+		{0, 0, strlen(token), (void *)token},
+		{0, 0, length, (void *)data},
+		{0, 0, extra_length, (void *)extra},
+	};
+	if (gcry_md_hash_buffers(GCRY_MD_SHA256, GCRY_MD_FLAG_HMAC, out, parts,
+			sizeofarr(parts)) != 0)
+		die("failed to compute mac", 1);
+}
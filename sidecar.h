@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>  // -> size_t
+#include <stdint.h>  // -> uint*_t
+#include <stdbool.h> // -> bool
+
+// Bits shared by the integrity trailer and the sidecars kept next to a log
+// (merkle nodes, time index, rollup): naming them, writing and reading hex
+// fields, and mac'ing with the log's token.
+
+#define SIDECAR_MAC_SIZE 32 // hmac-sha256
+
+char *sidecar_name(const char *log_filename, const char *suffix);
+// the log's name with `suffix` on the end. malloc'd, caller frees
+
+char *hex_encode(const uint8_t *bytes, size_t length, char *out);
+// writes `length` bytes as lowercase hex, no terminator. returns the end.
+
+const char *hex_field(
+	const char *iter, const char *end, size_t digits, uint64_t *out);
+// reads exactly `digits` hex digits followed by '#'. returns where the next
+// field starts, or NULL if it's malformed or runs past `end`.
+
+const char *hex_bytes(
+	const char *iter, const char *end, size_t length, uint8_t *out);
+// reads `length` bytes written out as hex. returns the position right after
+// them, or NULL if they're malformed or run past `end`.
+
+bool bytes_equal(const uint8_t *a, const uint8_t *b, size_t length);
+// compares without bailing early, so timing doesn't leak the matching prefix
+
+void token_mac(const char *token, const void *data, size_t length,
+	const void *extra, size_t extra_length, uint8_t out[SIDECAR_MAC_SIZE]);
+// hmac-sha256 of `data` then `extra` (which can be empty), keyed with the
+// log's token
@@ -0,0 +1,490 @@
+#! /bin/sh
+
+# checks logappend and logread from the command line: what goes in comes back
+# out, older logs still work, and tampering with a log or its sidecars is
+# caught. run it through `make test`, which builds everything first.
+#
+# each case leaves what the tools printed in $TEST_OUT (default ./test_out),
+# which is cleared before every run.
+
+OUT=${TEST_OUT:-./test_out}
+TOKEN=secret
+failures=0
+cases=0
+
+rm -rf "$OUT"
+mkdir -p "$OUT"
+
+# run <name> <command...>
+# runs a command with its output kept in $OUT/<name>.out, and passes on its
+# exit status
+run() {
+	name=$1
+	shift
+	LAST="$OUT/$name.out"
+	"$@" > "$LAST" 2>&1
+}
+
+fail() {
+	echo "FAIL: $1 (see $LAST)"
+	failures=$((failures + 1))
+}
+
+# expect_ok <name> <command...>, expect_fail <name> <command...>
+expect_ok() {
+	cases=$((cases + 1))
+	run "$@" || fail "$1 should have worked"
+}
+expect_fail() {
+	cases=$((cases + 1))
+	run "$@" && fail "$1 should have failed"
+}
+
+# expect_seen <text>, expect_unseen <text>: about the last command's output
+expect_seen() {
+	grep -qF -- "$1" "$LAST" || fail "expected '$1'"
+}
+expect_unseen() {
+	grep -qF -- "$1" "$LAST" && fail "didn't expect '$1'"
+}
+
+# poke <file> <offset> <bytes>: overwrites bytes in place
+poke() {
+	printf '%s' "$3" | dd of="$1" bs=1 seek="$2" conv=notrunc 2> /dev/null
+}
+
+# copy_log <from> <to>: a log along with its sidecars
+copy_log() {
+	for suffix in '' .merkle .index .rollup; do
+		[ -f "$1$suffix" ] && cp "$1$suffix" "$2$suffix"
+	done
+	return 0
+}
+
+LOG="$OUT/gallery"
+cat > "$OUT/gallery.batch" << EOF
+-K $TOKEN -T 1 -A -G Ann $LOG
+-K $TOKEN -T 2 -A -R 3 -G Ann $LOG
+-K $TOKEN -T 3 -A -E Bob $LOG
+-K $TOKEN -T 4 -A -R 7 -E Bob $LOG
+-K $TOKEN -T 5 -L -R 3 -G Ann $LOG
+EOF
+
+echo "integrity..."
+expect_ok append ./logappend -B "$OUT/gallery.batch"
+expect_ok read ./logread -K $TOKEN -S "$LOG"
+expect_seen "Read in log with 5 entries"
+expect_seen "[4] At 5 in room 3, guest Ann departs"
+expect_fail wrong-token ./logread -K other -S "$LOG"
+
+copy_log "$LOG" "$OUT/body"
+poke "$OUT/body" 20 X
+expect_fail tampered-body ./logread -K $TOKEN -S "$OUT/body"
+expect_seen "failed integrity check"
+expect_fail tampered-body-append \
+	./logappend -K $TOKEN -T 9 -L -G Ann "$OUT/body"
+
+copy_log "$LOG" "$OUT/trailer"
+# the last digit of the trailer's mac, changed to another one
+digit=$(tail -c 3 "$LOG" | head -c 1)
+[ "$digit" = 0 ] && digit=1 || digit=0
+poke "$OUT/trailer" $(($(wc -c < "$LOG") - 3)) $digit
+expect_fail tampered-trailer ./logread -K $TOKEN -S "$OUT/trailer"
+expect_seen "failed integrity check"
+
+# with its sidecar still there, a log with its trailer cut off isn't taken
+# for one from before trailers
+copy_log "$LOG" "$OUT/cut"
+head -c $(($(grep -bo ENDLOG "$LOG" | cut -d: -f1) + 6)) "$LOG" > "$OUT/cut"
+expect_fail cut-trailer ./logread -K $TOKEN -S "$OUT/cut"
+expect_seen "failed integrity check"
+
+# a lost sidecar is rebuilt, a broken one doesn't change what's read
+copy_log "$LOG" "$OUT/nosidecar"
+rm "$OUT/nosidecar.merkle"
+expect_ok no-sidecar ./logread -K $TOKEN -S "$OUT/nosidecar"
+expect_seen "Read in log with 5 entries"
+expect_ok no-sidecar-append \
+	./logappend -K $TOKEN -T 6 -L -R 7 -E Bob "$OUT/nosidecar"
+[ -f "$OUT/nosidecar.merkle" ] || fail "sidecar wasn't rebuilt"
+copy_log "$LOG" "$OUT/sidecar"
+poke "$OUT/sidecar.merkle" 4 0000
+expect_ok tampered-sidecar ./logread -K $TOKEN -S -T 2 4 "$OUT/sidecar"
+expect_seen "[3] At 4 in room 7, employee Bob arrives"
+
+# a log as written before trailers: the last record, then ENDLOG and nothing
+echo "logs from before trailers..."
+OLD="$OUT/old"
+printf 'STARTLOG%s*1#%%Ann#>#\n2#%%Ann#>#3#\na#&Bob#>#\nENDLOG' $TOKEN > "$OLD"
+expect_ok old-read ./logread -K $TOKEN -S "$OLD"
+expect_seen "no integrity trailer yet"
+expect_seen "[2] At 10, employee Bob arrives the gallery"
+expect_ok old-append ./logappend -K $TOKEN -T 11 -L -R 3 -G Ann "$OLD"
+expect_seen "Adding an integrity trailer"
+grep -q '^MERKLE#' "$OLD" || fail "old log didn't get a trailer"
+expect_ok old-reread ./logread -K $TOKEN -S "$OLD"
+expect_unseen "no integrity trailer yet"
+expect_seen "[3] At 11 in room 3, guest Ann departs"
+printf 'STARTLOG%s*1#%%Ann#>#\n2#%%Ann#>#3\nENDLOG' $TOKEN > "$OLD.broken"
+expect_fail old-broken ./logread -K $TOKEN -S "$OLD.broken"
+expect_seen "is broken"
+
+# expect_rows <text>: the last command's entry rows, in order
+expect_rows() {
+	grep '^\[' "$LAST" > "$LAST.rows"
+	[ -z "$1" ] && [ ! -s "$LAST.rows" ] && return
+	printf '%s\n' "$1" | cmp -s - "$LAST.rows" ||
+		fail "rows differ from what's expected"
+}
+
+echo "several logs at once..."
+EAST="$OUT/east"
+WEST="$OUT/west"
+cat > "$OUT/merge.batch" << EOF
+-K $TOKEN -T 1 -A -G Ann $EAST
+-K other -T 2 -A -G Cid $WEST
+-K $TOKEN -T 3 -A -R 1 -G Ann $EAST
+-K other -T 3 -A -R 2 -G Cid $WEST
+-K other -T 4 -L -R 2 -G Cid $WEST
+-K $TOKEN -T 5 -L -R 1 -G Ann $EAST
+EOF
+expect_ok merge-append ./logappend -B "$OUT/merge.batch"
+# by timestamp, then by the order the logs were given in
+expect_ok merge ./logread -K $TOKEN -S "$EAST" -K other "$WEST"
+expect_rows "[$EAST:0] At 1, guest Ann arrives the gallery
+[$WEST:0] At 2, guest Cid arrives the gallery
+[$EAST:1] At 3 in room 1, guest Ann arrives
+[$WEST:1] At 3 in room 2, guest Cid arrives
+[$WEST:2] At 4 in room 2, guest Cid departs
+[$EAST:2] At 5 in room 1, guest Ann departs"
+expect_ok merge-swapped ./logread -K other -S "$WEST" -K $TOKEN "$EAST"
+expect_rows "[$EAST:0] At 1, guest Ann arrives the gallery
+[$WEST:0] At 2, guest Cid arrives the gallery
+[$WEST:1] At 3 in room 2, guest Cid arrives
+[$EAST:1] At 3 in room 1, guest Ann arrives
+[$WEST:2] At 4 in room 2, guest Cid departs
+[$EAST:2] At 5 in room 1, guest Ann departs"
+# rows keep their place in their own log when only some are shown
+expect_ok merge-person \
+	./logread -K $TOKEN -R -G Ann -T 3 5 "$EAST" -K other "$WEST"
+expect_rows "[$EAST:1] 3, 1, guest Ann arrives
+[$EAST:2] 5, 1, guest Ann departs"
+# a log that can't be read is reported, the rest are still shown
+expect_fail merge-broken \
+	./logread -K $TOKEN -S "$EAST" "$OUT/missing" "$OUT/body"
+expect_seen "Error reading log file '$OUT/missing'"
+expect_seen "Error reading log file '$OUT/body'"
+expect_rows "[$EAST:0] At 1, guest Ann arrives the gallery
+[$EAST:1] At 3 in room 1, guest Ann arrives
+[$EAST:2] At 5 in room 1, guest Ann departs"
+
+# crowd <people> <first timestamp> <log>
+# a batch where everyone arrives, spends a while in a room and leaves again,
+# a few people at a time, over several hours
+crowd() {
+	awk -v people="$1" -v t="$2" -v logname="$3" -v token="$TOKEN" 'BEGIN {
+		letters = "abcdefghijklmnopqrstuvwxyz"
+		for (i = 0; i < people; i++) {
+			name = "P"
+			for (n = i; n > 0 || name == "P"; n = int(n / 26))
+				name = name substr(letters, n % 26 + 1, 1)
+			who = (i % 4 == 0 ? "-E " : "-G ") name " " logname
+			room = i % 7
+			print "-K " token " -T " t++ " -A " who
+			print "-K " token " -T " t++ " -A -R " room " " who
+			t += 300
+			print "-K " token " -T " t++ " -L -R " room " " who
+			if (i % 3 != 0) print "-K " token " -T " t++ " -L " who
+		}
+	}'
+}
+
+# occupancy <name> <log>: just the figures -O prints, in $OUT/<name>.figures
+occupancy() {
+	run "$1" ./logread -K $TOKEN -O "$2"
+	sed -n '/^OCCUPANCY/,$p' "$LAST" > "$OUT/$1.figures"
+}
+
+# expect_rollup <name> <log>: -O gives the same figures from the rollup as
+# when it goes through the events itself. the rollup is put back afterwards.
+expect_rollup() {
+	cases=$((cases + 1))
+	occupancy "$1" "$2"
+	mv "$2.rollup" "$2.kept"
+	occupancy "$1-rebuilt" "$2"
+	mv "$2.kept" "$2.rollup"
+	cmp -s "$OUT/$1.figures" "$OUT/$1-rebuilt.figures" ||
+		fail "$1 figures differ from a rebuild's"
+	LAST="$OUT/$1.out"
+}
+
+echo "occupancy..."
+ROLL="$OUT/rollup"
+crowd 400 1 "$ROLL" > "$OUT/rollup.batch"
+expect_ok rollup-append ./logappend -B "$OUT/rollup.batch"
+expect_unseen "rebuilding rollup"
+expect_rollup rollup "$ROLL"
+expect_unseen "Rebuilding occupancy"
+grep -q "^ guest Pb: " "$OUT/rollup.figures" || fail "rollup lost people"
+
+# appends rewrite the slots they touch, not the file
+cp "$ROLL.rollup" "$OUT/older.rollup"
+inode=$(ls -i "$ROLL.rollup" | cut -d' ' -f1)
+expect_ok rollup-in-place \
+	./logappend -K $TOKEN -T 999999 -A -R 2 -E Pb "$ROLL"
+expect_unseen "rebuilding rollup"
+[ "$(ls -i "$ROLL.rollup" | cut -d' ' -f1)" = "$inode" ] ||
+	fail "rollup was rewritten instead of updated in place"
+expect_rollup rollup-in-place "$ROLL"
+expect_unseen "Rebuilding occupancy"
+
+# a rollup saved for an older log, or tampered with, is rebuilt: a header
+# field, a name, and a slot cut off
+copy_log "$ROLL" "$OUT/stale"
+cp "$OUT/older.rollup" "$OUT/stale.rollup"
+expect_rollup rollup-stale "$OUT/stale"
+expect_seen "rollup doesn't match the log"
+size=$(wc -c < "$ROLL.rollup")
+for tamper in header name slot; do
+	copy_log "$ROLL" "$OUT/$tamper"
+	case $tamper in
+	header) poke "$OUT/$tamper.rollup" 20 0 ;;
+	name) poke "$OUT/$tamper.rollup" $((size - 2)) Q ;;
+	slot) head -c $((size - 80)) "$ROLL.rollup" > "$OUT/$tamper.rollup" ;;
+	esac
+	expect_rollup "rollup-$tamper" "$OUT/$tamper"
+	expect_seen "Rebuilding occupancy"
+done
+# appending to a log with a broken rollup still leaves it right
+expect_ok rollup-tampered-append \
+	./logappend -K $TOKEN -T 1000000 -L -R 2 -E Pb "$OUT/name"
+expect_rollup rollup-tampered-appended "$OUT/name"
+
+# pick <-S output> <S|R> <role> <name> <room> <from> <to>
+# picks the rows a filtered read should show out of an unfiltered one, in -S
+# or -R form. names match by prefix, an empty role, name or room matches
+# anything, and the gallery's own doors are room "gallery".
+pick() {
+	awk -v form="$2" -v role="$3" -v name="$4" -v room="$5" -v from="$6" \
+		-v to="$7" '/^\[/ {
+		t = $3; sub(/,$/, "", t)
+		if ($4 == "in") {
+			r = $6; sub(/,$/, "", r); who = $7; n = $8; event = $9
+		} else {
+			r = "gallery"; who = $4; n = $5; event = $6
+		}
+		if ((role != "" && who != role) || index(n, name) != 1 ||
+			(room != "" && r != room) || t + 0 < from || t + 0 > to)
+			next
+		if (form == "S") print
+		else print $1 " " t ", " (r == "gallery" ? -1 : r) ", " who " " \
+			n " " event
+	}' "$1"
+}
+
+echo "filtered reads..."
+expect_ok filter-all ./logread -K $TOKEN -S "$ROLL"
+ALL="$OUT/filter-all.out"
+expect_ok filter-person ./logread -K $TOKEN -R -G Pb "$ROLL"
+expect_rows "$(pick "$ALL" R guest Pb '' 0 4294967295)"
+expect_ok filter-room ./logread -K $TOKEN -S -W 2 "$ROLL"
+expect_rows "$(pick "$ALL" S '' '' 2 0 4294967295)"
+expect_ok filter-gallery ./logread -K $TOKEN -S -W gallery "$ROLL"
+expect_rows "$(pick "$ALL" S '' '' gallery 0 4294967295)"
+expect_ok filter-all-three \
+	./logread -K $TOKEN -R -E P -W 0 -T 20000 90000 "$ROLL"
+expect_rows "$(pick "$ALL" R employee P 0 20000 90000)"
+grep -q '^\[' "$LAST" || fail "filter-all-three showed nothing"
+expect_fail filter-occupancy ./logread -K $TOKEN -O -W 2 "$ROLL"
+
+# dump <separator>: turns batch lines into import lines
+dump() {
+	awk -v sep="$1" '{
+		room = ""
+		for (i = 1; i <= NF; i++) {
+			if ($i == "-T") t = $(i + 1)
+			if ($i == "-A" || $i == "-L") event = substr($i, 2)
+			if ($i == "-R") room = sep $(i + 1)
+			if ($i == "-E" || $i == "-G") who = substr($i, 2) sep $(i + 1)
+		}
+		print t sep who sep event room
+	}'
+}
+
+echo "bulk import..."
+crowd 150 1 "$OUT/batched" > "$OUT/batched.batch"
+expect_ok import-batched ./logappend -B "$OUT/batched.batch"
+expect_ok import-expected ./logread -K $TOKEN -S "$OUT/batched"
+BATCHED="$OUT/import-expected.out"
+occupancy import-batched-figures "$OUT/batched"
+sed -i "s|$OUT/batched|LOG|" "$OUT/import-batched-figures.figures"
+
+dump , < "$OUT/batched.batch" > "$OUT/import.csv"
+# tabs, out of order, with a comment and a blank line in between
+{
+	echo "# the same events, newest first"
+	dump "	" < "$OUT/batched.batch" | sort -t "	" -k 1,1nr
+	echo
+} > "$OUT/import.tsv"
+for format in csv tsv; do
+	expect_ok "import-$format" \
+		./logappend -K $TOKEN -I "$OUT/import.$format" "$OUT/$format"
+	expect_seen "imported $(wc -l < "$OUT/batched.batch") events"
+	expect_ok "import-$format-read" ./logread -K $TOKEN -S "$OUT/$format"
+	expect_rows "$(grep '^\[' "$BATCHED")"
+	occupancy "import-$format-figures" "$OUT/$format"
+	expect_unseen "Rebuilding occupancy"
+	sed -i "s|$OUT/$format|LOG|" "$OUT/import-$format-figures.figures"
+	cases=$((cases + 1))
+	cmp -s "$OUT/import-$format-figures.figures" \
+		"$OUT/import-batched-figures.figures" ||
+		fail "imported $format has different figures"
+done
+
+# nothing gets written if anything is wrong, or if the log already exists
+printf '1,G,Ann,A\n2,G,Ann,A,3\n3,G,Bob,L\n' > "$OUT/rules.csv"
+expect_fail import-rules ./logappend -K $TOKEN -I "$OUT/rules.csv" "$OUT/rules"
+expect_seen "line 3"
+printf '1,G,Ann,A\n2;G;Ann;L\n' > "$OUT/malformed.csv"
+expect_fail import-malformed \
+	./logappend -K $TOKEN -I "$OUT/malformed.csv" "$OUT/malformed"
+expect_seen "line 2"
+[ -e "$OUT/rules" ] || [ -e "$OUT/malformed" ] &&
+	fail "a failed import left a log behind"
+expect_fail import-existing \
+	./logappend -K $TOKEN -I "$OUT/import.csv" "$OUT/csv"
+expect_seen "already exists"
+
+# expect_window <name> <log> <from> <to>: -S -T gives the same rows as
+# picking them out of an unfiltered read, in $ALL
+expect_window() {
+	expect_ok "$1" ./logread -K $TOKEN -S -T "$3" "$4" "$2"
+	expect_rows "$(pick "$ALL" S '' '' '' "$3" "$4")"
+}
+
+echo "time ranges..."
+WIN="$OUT/window"
+crowd 2000 1 "$WIN" > "$OUT/window.batch"
+expect_ok window-append ./logappend -B "$OUT/window.batch"
+expect_ok window-all ./logread -K $TOKEN -S "$WIN"
+ALL="$OUT/window-all.out"
+# the start, the middle, the end, all of it, a single moment, a moment with
+# nothing in it, and past the end
+for range in "1 1000" "300000 310000" "600000 700000" "1 4294967295" \
+	"304 304" "305 305" "700000 800000"; do
+	expect_window "window-${range% *}" "$WIN" $range
+done
+grep -q '^\[' "$OUT/window-300000.out" || fail "the middle came out empty"
+expect_ok window-person ./logread -K $TOKEN -R -G Pc -T 500 100000 "$WIN"
+expect_rows "$(pick "$ALL" R guest Pc '' 500 100000)"
+
+# only the blocks the range covers are read: damage before the window goes
+# unnoticed, damage in it doesn't
+copy_log "$WIN" "$OUT/early"
+poke "$OUT/early" 100 X
+expect_window window-early-damage "$OUT/early" 600000 700000
+expect_fail window-early-damage-whole ./logread -K $TOKEN -S "$OUT/early"
+copy_log "$WIN" "$OUT/late"
+poke "$OUT/late" $(($(grep -bo ENDLOG "$WIN" | cut -d: -f1) - 20)) X
+expect_fail window-late-damage \
+	./logread -K $TOKEN -S -T 600000 700000 "$OUT/late"
+expect_seen "failed integrity check"
+
+# without a usable index or sidecar the log is read whole, with the same
+# result, and the next append puts the index back
+for broken in no-index bad-index stale-index no-sidecar; do
+	copy_log "$WIN" "$OUT/$broken"
+	case $broken in
+	no-index) rm "$OUT/$broken.index" ;;
+	bad-index) poke "$OUT/$broken.index" 300 7 ;;
+	stale-index) head -c 4000 "$WIN.index" > "$OUT/$broken.index" ;;
+	no-sidecar) rm "$OUT/$broken.merkle" ;;
+	esac
+	expect_window "window-$broken" "$OUT/$broken" 300000 310000
+done
+# a sidecar that doesn't match the log is damage too, not a reason to trust
+# the blocks
+copy_log "$WIN" "$OUT/bad-sidecar"
+poke "$OUT/bad-sidecar.merkle" 700 0000
+expect_fail window-bad-sidecar \
+	./logread -K $TOKEN -S -T 300000 310000 "$OUT/bad-sidecar"
+expect_seen "failed integrity check"
+expect_rows ""
+expect_ok window-reindex \
+	./logappend -K $TOKEN -T 900000 -A -G Zed "$OUT/no-index"
+[ -s "$OUT/no-index.index" ] || fail "index wasn't rebuilt"
+expect_window window-reindexed "$OUT/no-index" 300000 310000
+
+# same_rows <name> <log> <compact log> <logread args...>: both logs give the
+# same rows for the same read
+same_rows() {
+	same=$1 text=$2 compact=$3
+	shift 3
+	expect_ok "$same-text" ./logread -K $TOKEN "$@" "$text"
+	grep '^\[' "$LAST" > "$OUT/$same.expected"
+	expect_ok "$same" ./logread -K $TOKEN "$@" "$compact"
+	expect_rows "$(cat "$OUT/$same.expected")"
+}
+
+echo "compact logs..."
+PACKED="$OUT/packed"
+dump , < "$OUT/window.batch" > "$OUT/packed.csv"
+expect_ok compact-import \
+	./logappend -K $TOKEN -I "$OUT/packed.csv" -C "$PACKED"
+[ "$(head -c 15 "$PACKED")" = "STARTLOG$TOKEN\$" ] ||
+	fail "compact log isn't marked as one"
+[ $(wc -c < "$PACKED") -lt $(($(wc -c < "$WIN") / 2)) ] ||
+	fail "compact log isn't much smaller"
+same_rows compact-all "$WIN" "$PACKED" -S
+same_rows compact-person "$WIN" "$PACKED" -R -G Pc
+same_rows compact-employee "$WIN" "$PACKED" -R -E Pa
+same_rows compact-room "$WIN" "$PACKED" -S -W 3
+same_rows compact-gallery "$WIN" "$PACKED" -S -W gallery
+for range in "1 1000" "300000 310000" "600000 700000" "305 305"; do
+	same_rows "compact-${range% *}" "$WIN" "$PACKED" -S -T $range
+done
+occupancy compact-figures "$PACKED"
+occupancy compact-text-figures "$WIN"
+sed -i "s|$PACKED|LOG|" "$OUT/compact-figures.figures"
+sed -i "s|$WIN|LOG|" "$OUT/compact-text-figures.figures"
+cases=$((cases + 1))
+cmp -s "$OUT/compact-figures.figures" "$OUT/compact-text-figures.figures" ||
+	fail "compact log has different figures"
+
+# appends, one at a time and in batches, keep the encoding and fill the last
+# frame before starting another. a text log stays text even with -C.
+copy_log "$WIN" "$OUT/grown"
+copy_log "$PACKED" "$OUT/grown-packed"
+for log in grown grown-packed; do
+	expect_ok "compact-append-$log" \
+		./logappend -K $TOKEN -T 700000 -A -C -G Zed "$OUT/$log"
+	crowd 300 700001 "$OUT/$log" > "$OUT/$log.batch"
+	expect_ok "compact-batch-$log" ./logappend -B "$OUT/$log.batch"
+done
+[ "$(head -c 15 "$OUT/grown")" = "STARTLOG$TOKEN*" ] ||
+	fail "-C changed a text log's encoding"
+[ "$(head -c 15 "$OUT/grown-packed")" = "STARTLOG$TOKEN\$" ] ||
+	fail "an append changed a compact log's encoding"
+same_rows compact-appended "$OUT/grown" "$OUT/grown-packed" -S
+same_rows compact-appended-window "$OUT/grown" "$OUT/grown-packed" \
+	-S -T 690000 720000
+expect_rollup compact-appended-figures "$OUT/grown-packed"
+
+# damage anywhere in a compact body is caught like in a text one, and an
+# append can't build on a broken last frame
+endlog=$(grep -abo ENDLOG "$PACKED" | tail -1 | cut -d: -f1)
+for at in 100 $((endlog / 2)) $((endlog - 10)); do
+	copy_log "$PACKED" "$OUT/dented"
+	poke "$OUT/dented" $at X
+	expect_fail "compact-damage-$at" ./logread -K $TOKEN -S "$OUT/dented"
+	expect_seen "failed integrity check"
+	expect_rows ""
+done
+expect_fail compact-damage-append \
+	./logappend -K $TOKEN -T 700000 -A -G Zed "$OUT/dented"
+copy_log "$PACKED" "$OUT/dented"
+poke "$OUT/dented" 100 X
+same_rows compact-damage-window "$WIN" "$OUT/dented" -S -T 600000 700000
+
+echo "$cases cases, $failures failed"
+[ $failures -eq 0 ]
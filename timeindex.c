@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "sidecar.h"
+#include "timeindex.h"
+
+// "TIMEINDEX#" <stride, 8 hex> "#" <id, 32 hex> "#" <records, 16 hex> "#"
+// <samples, 16 hex> "#" <last timestamp, 8 hex> "#" <latest timestamp, 8 hex>
+// "#" <sorted, 0 or 1> "#" <mac, 64 hex> "#\n"
+#define TIMEINDEX_HEADER_MAC_AT \
+	(10 + 9 + TIMEINDEX_ID_SIZE * 2 + 1 + 17 + 17 + 9 + 9 + 2)
+#define TIMEINDEX_HEADER_SIZE (TIMEINDEX_HEADER_MAC_AT + 64 + 2)
+
+// <offset, 16 hex> "#" <ordinal, 16 hex> "#" <latest timestamp before, 8 hex>
+// "#" <mac, 32 hex> "#\n"
+#define TIMEINDEX_SAMPLE_MAC_SIZE 16 // hmac-sha256, cut short
+#define TIMEINDEX_SAMPLE_MAC_AT   (17 + 17 + 9)
+#define TIMEINDEX_SAMPLE_SIZE \
+	(TIMEINDEX_SAMPLE_MAC_AT + TIMEINDEX_SAMPLE_MAC_SIZE * 2 + 2)
+
+// what a sample's mac covers: the index it's in, where it is in there, and
+// the sample itself
+static void timeindex_sample_mac(const TimeIndex *index, uint64_t position,
+	const TimeIndexSample *sample, uint8_t out[TIMEINDEX_SAMPLE_MAC_SIZE]) {
+	uint8_t data[TIMEINDEX_ID_SIZE + 8 + 8 + 8 + 4];
+	memcpy(data, index->id, TIMEINDEX_ID_SIZE);
+	uint64_t values[] = {position, sample->offset, sample->ordinal};
+	for (size_t i = 0; i < 3; i++) {
+		for (int j = 0; j < 8; j++)
+			data[TIMEINDEX_ID_SIZE + 8 * i + j] =
+				(uint8_t)(values[i] >> (56 - 8 * j));
+	}
+	for (int j = 0; j < 4; j++)
+		data[TIMEINDEX_ID_SIZE + 24 + j] =
+			(uint8_t)(sample->max_before >> (24 - 8 * j));
+
+	uint8_t mac[SIDECAR_MAC_SIZE];
+	token_mac(index->token, data, sizeof(data), NULL, 0, mac);
+	memcpy(out, mac, TIMEINDEX_SAMPLE_MAC_SIZE);
+}
+
+// Formats the header, mac and all. `out` needs TIMEINDEX_HEADER_SIZE + 1
+// bytes.
+static void timeindex_header_format(
+	const TimeIndex *index, const MerkleHash *log_mac, char *out) {
+	char id[TIMEINDEX_ID_SIZE * 2 + 1];
+	*hex_encode(index->id, TIMEINDEX_ID_SIZE, id) = '\0';
+
+	sprintf(out, "TIMEINDEX#%08x#%s#%016llx#%016llx#%08x#%08x#%c#",
+		TIMEINDEX_STRIDE, id, (unsigned long long)index->records_num,
+		(unsigned long long)index->samples_num, index->last_timestamp,
+		index->max_timestamp, index->sorted ? '1' : '0');
+
+	uint8_t mac[SIDECAR_MAC_SIZE];
+	token_mac(index->token, out, TIMEINDEX_HEADER_MAC_AT, log_mac->bytes,
+		MERKLE_HASH_SIZE, mac);
+	hex_encode(mac, sizeof(mac), &out[TIMEINDEX_HEADER_MAC_AT]);
+	strcpy(&out[TIMEINDEX_HEADER_SIZE - 2], "#\n");
+}
+
+char *timeindex_sidecar_name(const char *log_filename) {
+	return sidecar_name(log_filename, TIMEINDEX_SIDECAR_SUFFIX);
+}
+
+bool timeindex_create(
+	TimeIndex *index, const char *log_filename, const char *token) {
+	char *name = timeindex_sidecar_name(log_filename);
+	index->file = fopen(name, "w+b");
+	free(name);
+	if (index->file == NULL) return false;
+
+	index->token = token;
+	gcry_create_nonce(index->id, TIMEINDEX_ID_SIZE);
+	index->records_num = 0;
+	index->samples_num = 0;
+	index->last_timestamp = 0;
+	index->max_timestamp = 0;
+	index->sorted = true;
+
+	// room for the header, which is only filled in once it's finished
+	char blank[TIMEINDEX_HEADER_SIZE];
+	memset(blank, ' ', sizeof(blank));
+	blank[sizeof(blank) - 1] = '\n';
+	if (fwrite(blank, 1, sizeof(blank), index->file) != sizeof(blank)) {
+		timeindex_close(index);
+		return false;
+	}
+	return true;
+}
+
+const char *timeindex_open(TimeIndex *index, const char *log_filename,
+	const char *token, const MerkleHash *log_mac, bool writable) {
+	char *name = timeindex_sidecar_name(log_filename);
+	index->file = fopen(name, writable ? "r+b" : "rb");
+	free(name);
+	if (index->file == NULL) return "log has no time index";
+	index->token = token;
+
+	char header[TIMEINDEX_HEADER_SIZE + 1];
+	const char *end = &header[TIMEINDEX_HEADER_SIZE];
+	uint64_t stride, records_num, samples_num, last, max;
+	const char *iter = header;
+	bool ok =
+		fread(header, 1, TIMEINDEX_HEADER_SIZE, index->file) ==
+			TIMEINDEX_HEADER_SIZE &&
+		strncmp(header, "TIMEINDEX#", 10) == 0 &&
+		(iter = hex_field(&header[10], end, 8, &stride)) != NULL &&
+		(iter = hex_bytes(iter, end, TIMEINDEX_ID_SIZE, index->id)) != NULL &&
+		*iter++ == '#' &&
+		(iter = hex_field(iter, end, 16, &records_num)) != NULL &&
+		(iter = hex_field(iter, end, 16, &samples_num)) != NULL &&
+		(iter = hex_field(iter, end, 8, &last)) != NULL &&
+		(iter = hex_field(iter, end, 8, &max)) != NULL &&
+		(*iter == '0' || *iter == '1') && iter[1] == '#';
+	if (!ok || stride != TIMEINDEX_STRIDE) {
+		timeindex_close(index);
+		return "time index has a malformed header";
+	}
+	index->records_num = records_num;
+	index->samples_num = samples_num;
+	index->last_timestamp = (uint32_t)last;
+	index->max_timestamp = (uint32_t)max;
+	index->sorted = *iter == '1';
+
+	// the header is rebuilt rather than checked field by field, so anything
+	// that wasn't written by timeindex_header_format doesn't match
+	char expected[TIMEINDEX_HEADER_SIZE + 1];
+	timeindex_header_format(index, log_mac, expected);
+	if (!bytes_equal((uint8_t *)header, (uint8_t *)expected,
+			TIMEINDEX_HEADER_SIZE)) {
+		timeindex_close(index);
+		return "time index doesn't belong to this log";
+	}
+
+	// new samples go after the last one the header vouches for
+	long samples_end =
+		TIMEINDEX_HEADER_SIZE + (long)samples_num * TIMEINDEX_SAMPLE_SIZE;
+	if (writable && fseek(index->file, samples_end, SEEK_SET) != 0) {
+		timeindex_close(index);
+		return "time index is truncated";
+	}
+	return NULL;
+}
+
+void timeindex_add(TimeIndex *index, uint64_t offset, uint32_t timestamp) {
+	if (index->records_num % TIMEINDEX_STRIDE == 0) {
+		TimeIndexSample sample;
+		sample.offset = offset;
+		sample.ordinal = index->records_num;
+		sample.max_before = index->records_num > 0 ? index->max_timestamp : 0;
+
+		uint8_t mac[TIMEINDEX_SAMPLE_MAC_SIZE];
+		timeindex_sample_mac(index, index->samples_num, &sample, mac);
+		char line[TIMEINDEX_SAMPLE_SIZE + 1];
+		sprintf(line, "%016llx#%016llx#%08x#",
+			(unsigned long long)sample.offset,
+			(unsigned long long)sample.ordinal, sample.max_before);
+		hex_encode(mac, sizeof(mac), &line[TIMEINDEX_SAMPLE_MAC_AT]);
+		strcpy(&line[TIMEINDEX_SAMPLE_SIZE - 2], "#\n");
+		if (fwrite(line, 1, TIMEINDEX_SAMPLE_SIZE, index->file) !=
+			TIMEINDEX_SAMPLE_SIZE)
+			die("couldn't write time index!", 1);
+		index->samples_num++;
+	}
+
+	if (index->records_num > 0 && timestamp < index->last_timestamp)
+		index->sorted = false;
+	if (index->records_num == 0 || timestamp > index->max_timestamp)
+		index->max_timestamp = timestamp;
+	index->last_timestamp = timestamp;
+	index->records_num++;
+}
+
+bool timeindex_finish(TimeIndex *index, const MerkleHash *log_mac) {
+	char header[TIMEINDEX_HEADER_SIZE + 1];
+	timeindex_header_format(index, log_mac, header);
+	bool saved = fseek(index->file, 0, SEEK_SET) == 0 &&
+		fwrite(header, 1, TIMEINDEX_HEADER_SIZE, index->file) ==
+			TIMEINDEX_HEADER_SIZE;
+	saved &= fclose(index->file) == 0;
+	index->file = NULL;
+	return saved;
+}
+
+void timeindex_close(TimeIndex *index) {
+	if (index->file != NULL) fclose(index->file);
+	index->file = NULL;
+}
+
+// Reads and checks one sample
+static const char *timeindex_sample(
+	TimeIndex *index, uint64_t position, TimeIndexSample *out) {
+	char line[TIMEINDEX_SAMPLE_SIZE];
+	long at = TIMEINDEX_HEADER_SIZE + (long)position * TIMEINDEX_SAMPLE_SIZE;
+	if (fseek(index->file, at, SEEK_SET) != 0 ||
+		fread(line, 1, sizeof(line), index->file) != sizeof(line))
+		return "time index is truncated";
+
+	uint64_t max_before;
+	uint8_t stored[TIMEINDEX_SAMPLE_MAC_SIZE], expected[sizeof(stored)];
+	const char *iter = line, *end = &line[sizeof(line)];
+	if ((iter = hex_field(iter, end, 16, &out->offset)) == NULL ||
+		(iter = hex_field(iter, end, 16, &out->ordinal)) == NULL ||
+		(iter = hex_field(iter, end, 8, &max_before)) == NULL ||
+		(iter = hex_bytes(iter, end, TIMEINDEX_SAMPLE_MAC_SIZE, stored)) ==
+			NULL ||
+		*iter != '#')
+		return "time index has a malformed sample";
+	out->max_before = (uint32_t)max_before;
+
+	timeindex_sample_mac(index, position, out, expected);
+	if (!bytes_equal(stored, expected, sizeof(stored)))
+		return "time index sample was modified";
+	return NULL;
+}
+
+const char *timeindex_seek(
+	TimeIndex *index, uint32_t from, TimeIndexSample *out) {
+	out->offset = 0;
+	out->ordinal = 0;
+	out->max_before = 0;
+	if (index->samples_num == 0) return NULL;
+
+	// the first sample has nothing before it, so it always qualifies. look
+	// for the last one after it that still has only earlier records before it.
+	uint64_t low = 0, high = index->samples_num - 1;
+	const char *msg = timeindex_sample(index, 0, out);
+	while (msg == NULL && low < high) {
+		uint64_t middle = low + (high - low + 1) / 2;
+		TimeIndexSample sample;
+		if ((msg = timeindex_sample(index, middle, &sample)) != NULL) break;
+		if (sample.max_before < from) {
+			low = middle;
+			*out = sample;
+		} else {
+			high = middle - 1;
+		}
+	}
+	return msg;
+}
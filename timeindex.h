@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>  // -> uint*_t
+#include <stdio.h>   // -> FILE
+#include <stdbool.h> // -> bool
+
+#include "merkle.h"
+
+// A sparse index from timestamps to where records start in a log's body, kept
+// in a sidecar next to the log (see TIMEINDEX_SIDECAR_SUFFIX). With it, a
+// question about a window of time only has to read that window.
+//
+// every TIMEINDEX_STRIDE-th record gets a sample: where it starts, which
+// record it is, and the latest timestamp of any record before it. those
+// latest timestamps never go down, so the samples can be binary searched even
+// if a log's timestamps ever went backwards.
+//
+// the header is mac'd with the log's token along with the log's own root mac,
+// so an index only ever matches the exact log it was written for. samples
+// carry their own macs, so a search only checks the samples it visits.
+
+#define TIMEINDEX_SIDECAR_SUFFIX ".index"
+#define TIMEINDEX_STRIDE         64 // records per sample
+#define TIMEINDEX_ID_SIZE        16
+
+typedef struct {
+	uint64_t offset;     // where the record starts in the body
+	uint64_t ordinal;    // which record it is
+	uint32_t max_before; // latest timestamp before it, 0 for the first record
+} TimeIndexSample;
+
+typedef struct {
+	FILE *file;
+	const char *token;
+	uint8_t id[TIMEINDEX_ID_SIZE]; // random, ties samples to their index
+	uint64_t records_num;
+	uint64_t samples_num;
+	uint32_t last_timestamp, max_timestamp;
+	bool sorted; // whether timestamps never went backwards
+} TimeIndex;
+
+bool timeindex_create(
+	TimeIndex *, const char *log_filename, const char *token);
+// starts a new, empty index in place of any old one. returns false if the
+// sidecar couldn't be created.
+
+const char *timeindex_open(TimeIndex *, const char *log_filename,
+	const char *token, const MerkleHash *log_mac, bool writable);
+// opens a log's index, as long as it was finished with the log's current
+// root mac (see merkle_root_mac). returns an error message otherwise.
+
+void timeindex_add(TimeIndex *, uint64_t offset, uint32_t timestamp);
+// call for every record, in order
+
+bool timeindex_finish(TimeIndex *, const MerkleHash *log_mac);
+// ties the index to the log's new root mac, and closes it
+
+void timeindex_close(TimeIndex *);
+// closes without saving anything
+
+const char *timeindex_seek(
+	TimeIndex *, uint32_t from, TimeIndexSample *out);
+// finds the last sample with nothing at or after `from` before it, so reading
+// on from there turns up every such record. returns an error message if a
+// sample it looked at was tampered with.
+
+char *timeindex_sidecar_name(const char *log_filename);
+// malloc'd, caller frees
@@ -37,7 +37,7 @@ cat > logappend_tmp.batch << STUFF
 -K  secret -T 3 -A -G Jameees log2
 STUFF
 
-rm log2
+rm -f log2 log2.merkle log2.rollup log2.index
 valgrind --tool=memcheck --leak-check=yes --show-reachable=yes --num-callers=2 --track-fds=yes ./logappend -B logappend_tmp.batch
 valgrind --tool=memcheck --leak-check=yes --show-reachable=yes --num-callers=5 --track-fds=yes ./logread -K secret -S log2
-rm logappend_tmp.batch log2
\ No newline at end of file
+rm logappend_tmp.batch log2 log2.merkle log2.rollup log2.index
\ No newline at end of file